@@ -0,0 +1,219 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __Affinity_H__
+#define __Affinity_H__
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <new>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace MultyQueueProcessor
+{
+    /// Defines how the queue storage should be placed on the NUMA node
+    enum class ENumaPlacement : int
+    {
+        NONE,        /// Default allocation, pages are placed by the thread which touches them first
+        FIRST_TOUCH, /// Pages are touched by the calling thread temporarily migrated to the node
+        BIND         /// Pages are explicitly bound to the node with mbind
+    };
+
+    /**
+        \brief Helpers to pin threads to cpus or NUMA nodes and to allocate memory on the certain node.
+         It is implemented for Linux only, on other platforms pinning fails and memory is allocated as usual.
+    */
+    class CAffinity
+    {
+    public:
+        /**
+            It returns cpus which belong to the NUMA node.
+            \param [in] node - index of NUMA node.
+            \return list of cpus or empty list if the node doesn't exist.
+        */
+        static std::vector<int> NodeCpus(int node)
+        {
+            std::vector<int> cpus;
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!std::getline(file, list))
+                return cpus;
+
+            // Format is comma separated ranges, for example "0-3,8-11"
+            size_t pos = 0;
+            while (pos < list.size())
+            {
+                size_t end = list.find(',', pos);
+                if (end == std::string::npos)
+                    end = list.size();
+
+                const std::string range = list.substr(pos, end - pos);
+                const size_t dash = range.find('-');
+                if (!range.empty())
+                {
+                    const int first = std::stoi(range.substr(0, dash));
+                    const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                    for (int cpu = first; cpu <= last; ++cpu)
+                        cpus.push_back(cpu);
+                }
+                pos = end + 1;
+            }
+            return cpus;
+        }
+
+        /**
+            It returns NUMA node of the cpu.
+            \param [in] cpu - index of cpu.
+            \return index of NUMA node or -1 if it is unknown.
+        */
+        static int CpuNode(int cpu)
+        {
+            for (int node = 0; ; ++node)
+            {
+                const std::vector<int> cpus = NodeCpus(node);
+                if (cpus.empty())
+                    return -1;
+
+                for (int c : cpus)
+                {
+                    if (c == cpu)
+                        return node;
+                }
+            }
+        }
+
+        /**
+            It pins the thread to the set of cpus.
+            \param [in] handle - native handle of the thread.
+            \param [in] cpus - list of cpus, empty list allows all cpus.
+            \return true if the thread has been pinned or false in other way.
+        */
+        template<typename Handle>
+        static bool PinThread(Handle handle, const std::vector<int>& cpus)
+        {
+#ifdef __linux__
+            cpu_set_t set;
+            FillCpuSet(set, cpus);
+            return pthread_setaffinity_np(handle, sizeof(set), &set) == 0;
+#else
+            (void)handle;
+            (void)cpus;
+            return false;
+#endif
+        }
+
+        /**
+            It allocates memory for the queue storage according to placement.
+            \param [in] bytes - size of memory.
+            \param [in] node - index of NUMA node or -1 for default allocation.
+            \param [in] placement - value from ENumaPlacement enum.
+            \return pointer to memory, it should be released by Free with the same arguments.
+        */
+        static void* Allocate(size_t bytes, int node, ENumaPlacement placement)
+        {
+            if (bytes == 0)
+                return nullptr;
+
+#ifdef __linux__
+            if (node >= 0 && placement != ENumaPlacement::NONE)
+            {
+                void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (ptr == MAP_FAILED)
+                    throw std::bad_alloc();
+
+                if (placement == ENumaPlacement::BIND)
+                {
+                    Bind(ptr, bytes, node);
+                }
+                else
+                {
+                    TouchOnNode(ptr, bytes, node);
+                }
+                return ptr;
+            }
+#endif
+            return ::operator new(bytes);
+        }
+
+        /**
+            It releases memory allocated by Allocate.
+        */
+        static void Free(void* ptr, size_t bytes, int node, ENumaPlacement placement)
+        {
+            if (ptr == nullptr)
+                return;
+
+#ifdef __linux__
+            if (node >= 0 && placement != ENumaPlacement::NONE)
+            {
+                munmap(ptr, bytes);
+                return;
+            }
+#else
+            (void)bytes;
+            (void)node;
+            (void)placement;
+#endif
+            ::operator delete(ptr);
+        }
+
+    private:
+#ifdef __linux__
+        static void FillCpuSet(cpu_set_t& set, const std::vector<int>& cpus)
+        {
+            CPU_ZERO(&set);
+            if (cpus.empty())
+            {
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                    CPU_SET(cpu, &set);
+            }
+            else
+            {
+                for (int cpu : cpus)
+                    CPU_SET(cpu, &set);
+            }
+        }
+
+        static void Bind(void* ptr, size_t bytes, int node)
+        {
+            const int MPOL_BIND_MODE = 2;
+            const size_t bits = sizeof(unsigned long) * 8;
+            std::vector<unsigned long> mask(node / bits + 1, 0);
+            mask[node / bits] |= 1UL << (node % bits);
+
+            // Failure is not fatal, memory stays usable with the default policy
+            syscall(SYS_mbind, ptr, bytes, MPOL_BIND_MODE, mask.data(), mask.size() * bits + 1, 0);
+        }
+
+        static void TouchOnNode(void* ptr, size_t bytes, int node)
+        {
+            const std::vector<int> cpus = NodeCpus(node);
+            cpu_set_t previous;
+            bool migrate = !cpus.empty() && sched_getaffinity(0, sizeof(previous), &previous) == 0;
+            if (migrate)
+            {
+                cpu_set_t set;
+                FillCpuSet(set, cpus);
+                migrate = sched_setaffinity(0, sizeof(set), &set) == 0;
+            }
+
+            std::memset(ptr, 0, bytes);
+
+            if (migrate)
+                sched_setaffinity(0, sizeof(previous), &previous);
+        }
+#endif
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __Affinity_H__
@@ -1,204 +1,1112 @@
-// Copyright 2020 Mykhailo Velygodskyi.
-// All Rights Reserved.
-
-#pragma once
-#ifndef __CPQueue_H__
-#define __CPQueue_H__
-
-#include <queue>
-#include <mutex>
-#include <condition_variable>
-#include <cassert>
-
-namespace 
-{
-    const size_t MAX_CAPACITY = 1000;
-}
-
-namespace MultyQueueProcessor
-{
-    /**
-    \brief The CMultiQueueProcessor is a template class which allows to create and process multiple queues.
-    Each queue should have unique id. All queues could be filled in a separate threads from any numbers of producers,
-    but each queue is able to work with only one consumer. All the queues are processed in one separate internal thread.
-    */
-    template<typename T>
-    class IConsumer
-    {
-    public:
-        virtual ~IConsumer() {}
-        virtual void Consume(const T &value) = 0;
-    };
-
-    
-    /// Defines how the queue should work when it is full
-    enum class EFullMode : int
-    {
-        SKIP_LAST,  /// Skip element if the queue is full
-        DROP_FIRST, /// Pop first element from queue and push new one in the end
-        WAIT        /// Wait till queue will be available to get new element
-    };
-
-    /**
-        \brief Internal template which is is thread safe wrapper for the queue container.
-         It allows to associate certain consumer to the internal queue.
-    */
-    template<typename T>
-    class CPQueue
-    {
-    public:
-
-        /**
-            \brief Internal interface to notify that the queue has received new element.
-        */
-        class ICPQNotifier
-        {
-        public:
-            ICPQNotifier() {}
-            virtual ~ICPQNotifier() {}
-            virtual void Notify() = 0;
-        };
-
-    public:
-        /**
-             Constructor of the queue
-             \param [in] max_size - Max number of elements in queue.
-             \param [in] fm - value from EFullMode enum. It defines how the queue should work when it is full.
-             \param [in] skip_no_cons - boolean flag which says if the queue needs to skip elements in case of no consumer.
-             \param [in] notifier - pointer to object who need to know that the queue has received new element, it should be inherited from ICPNotifier interface. 
-        */
-        CPQueue(size_t max_size = MAX_CAPACITY,
-            EFullMode fm = EFullMode::SKIP_LAST,
-            bool skip_no_cons = true,
-            ICPQNotifier * notifier = nullptr) : maxSize(max_size),
-            full_mode(fm),
-            skip_if_no_consumer(skip_no_cons),
-            notifier(notifier) {}
-
-        ~CPQueue() {}
-
-        /**
-            It sets certain consumer to process the queue.
-            \param [in] cons - pointer to consumer which inheritaed from IConsumer interface.
-        */
-        void SetConsumer(IConsumer<T>* cons)
-        {
-            std::lock_guard<std::mutex> loc(consumer_mtx);
-            consumer = cons;
-        }
-
-
-        /**
-            It push the new element to queue. Thread safe operation.
-            \param [in] value - element which should be placed to the queue.
-        */
-        void Push(const T& value)
-        {
-            if (skip_if_no_consumer)
-            {
-                std::lock_guard<std::mutex> loc(consumer_mtx);
-                if (consumer == nullptr)
-                    return;
-            }
-
-            std::unique_lock<std::mutex> loc(mtx);
-            const bool is_full = cpq.size() == maxSize;
-
-            if (is_full)
-            {
-                if (full_mode == EFullMode::SKIP_LAST)
-                {
-                    return;
-                }
-                else if (full_mode == EFullMode::DROP_FIRST)
-                {
-                    cpq.pop();
-                }
-                else if (full_mode == EFullMode::WAIT)
-                {
-                    cv.wait(loc, [this]() { return cpq.size() < maxSize; });
-                }
-                else
-                    assert(false);
-            }
-
-            cpq.push(value);
-            loc.unlock();
-
-            if (notifier)
-                notifier->Notify();
-        }
-
-        /**
-            Pop the element from the queue and pass it to consumer.
-            \return true if element has been passed to consumer ot false in other way. 
-        */
-        bool Consume()
-        {
-            std::lock_guard<std::mutex> consumer_loc(consumer_mtx);
-            if (consumer == nullptr)
-                return false;
-
-            std::unique_lock<std::mutex> q_loc(mtx);
-            const bool is_empty = cpq.size() == 0;
-            if (is_empty)
-            {
-                return false;
-            }
-            else
-            {
-                consumer->Consume(cpq.front());
-                cpq.pop();
-            }
-
-            if (full_mode == EFullMode::WAIT)
-            {
-                cv.notify_all();
-            }
-
-            q_loc.unlock();
-
-            return true;
-        }
-
-        /**
-            It push the new element to queue. Thread safe operation.
-            \return number of elements in queue. 
-        */
-        size_t size() const
-        {
-            std::lock_guard<std::mutex> loc(mtx);
-            return cpq.size();
-        }
-
-        /**
-            It cleares the queue.
-        */
-        void Clear()
-        {
-            std::unique_lock<std::mutex> loc(mtx);
-            cpq = {};
-            loc.unlock();
-            if (full_mode == EFullMode::WAIT)
-            {
-                cv.notify_all();
-            }
-        }
-
-    private:
-        std::condition_variable cv;
-        mutable std::mutex mtx;
-        std::queue<T> cpq;
-
-        size_t maxSize;
-        ICPQNotifier* notifier;
-        EFullMode full_mode;
-        bool skip_if_no_consumer;
-
-        std::mutex consumer_mtx;
-        IConsumer<T>* consumer = nullptr;
-    };
-
-} // end namespace MultyQueueProcessor
-
-#endif
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __CPQueue_H__
+#define __CPQueue_H__
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#include <cstdint>
+#include <cassert>
+#include <memory>
+#include <type_traits>
+#include <string>
+#include <functional>
+#include <atomic>
+#include <iterator>
+#include <algorithm>
+#include <unordered_map>
+#include "RingBuffer.h"
+#include "SegmentLog.h"
+#include "Serializer.h"
+#include "RateLimiter.h"
+#include "LatencyTrace.h"
+#include "EventTrace.h"
+
+namespace 
+{
+    const size_t MAX_CAPACITY = 1000;
+    const size_t CACHE_LINE_SIZE = 64;
+}
+
+// Member groups written by different threads start new cache lines. MQP_PACKED_LAYOUT keeps the members packed
+// as they were before the grouping, it is used to compare both layouts, see LayoutBench
+#ifdef MQP_PACKED_LAYOUT
+#define MQP_CACHE_ALIGNED
+#else
+#define MQP_CACHE_ALIGNED alignas(CACHE_LINE_SIZE)
+#endif
+
+namespace MultyQueueProcessor
+{
+    /**
+    \brief The CMultiQueueProcessor is a template class which allows to create and process multiple queues.
+    Each queue should have unique id. All queues could be filled in a separate threads from any numbers of producers,
+    but each queue is able to work with only one consumer. All the queues are processed in one separate internal thread.
+    */
+    template<typename T>
+    class IConsumer
+    {
+    public:
+        virtual ~IConsumer() {}
+        virtual void Consume(const T &value) = 0;
+    };
+
+    
+    /**
+        \brief Base class for objects whose members are grouped with alignas(CACHE_LINE_SIZE).
+         It guarantees cache line alignment for heap allocated objects, which plain new does not do before C++17.
+    */
+    class CCacheLineAligned
+    {
+    public:
+        static void* operator new(size_t size)
+        {
+            void* raw = ::operator new(size + CACHE_LINE_SIZE + sizeof(void*));
+            const uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+            reinterpret_cast<void**>(aligned)[-1] = raw;
+            return reinterpret_cast<void*>(aligned);
+        }
+
+        static void operator delete(void* ptr)
+        {
+            if (ptr)
+                ::operator delete(reinterpret_cast<void**>(ptr)[-1]);
+        }
+    };
+
+    /// Defines how the queue should work when it is full
+    enum class EFullMode : int
+    {
+        SKIP_LAST,  /// Skip element if the queue is full
+        DROP_FIRST, /// Pop first element from queue and push new one in the end
+        WAIT,       /// Wait till queue will be available to get new element
+        SPILL       /// Write element to the overflow file and read it back in order when the queue drains
+    };
+
+    /**
+        \brief Settings of the queue. The defaults are the same as for the CPQueue constructor.
+    */
+    template<typename T>
+    struct SQueueOptions
+    {
+        size_t capacity = MAX_CAPACITY;                              /// Max number of elements in queue
+        EFullMode full_mode = EFullMode::SKIP_LAST;                  /// How the queue should work when it is full
+        bool skip_if_no_consumer = true;                             /// Skip elements in case of no consumer
+        int numa_node = -1;                                          /// NUMA node of the queue storage, -1 means no preference
+        ENumaPlacement numa_placement = ENumaPlacement::FIRST_TOUCH; /// How the storage is placed on numa_node
+        SLogOptions persistence;                                     /// Durable log of the queue, empty path keeps the queue in memory only
+        SLogOptions spill;                                           /// Overflow log for EFullMode::SPILL, empty path means a file in the temp directory
+        size_t partitions = 1;                                       /// Number of ordered lanes, each lane has its own capacity and log
+        std::function<size_t(const T&)> partition_function;          /// Maps element to its lane, required if partitions > 1
+        std::chrono::steady_clock::duration ttl = std::chrono::steady_clock::duration::zero(); /// Max time an element waits in queue, zero means no expiry
+        double rate_limit = 0;                                       /// Max number of elements passed to consumer per second, 0 means no limit
+        double rate_burst = 1;                                       /// Max number of elements passed to consumer at once under rate_limit
+        std::function<uint64_t(const T&)> conflation_key;            /// Enables conflation, new element replaces queued one with the same key. Not compatible with persistence and SPILL
+        size_t staging_size = 0;                                     /// Number of elements each producer thread stages before it puts them in queue at once, 0 disables staging. Not compatible with WAIT
+        std::chrono::steady_clock::duration staging_delay = std::chrono::milliseconds(1); /// Max time an element stays staged, zero means till the stage is full or flushed
+    };
+
+    /**
+        \brief Full policy of CPQueue which keeps the full mode and skipping of elements in case of no consumer
+         in the queue object, they are read on every push. The mode could be changed by CPQueue::Reconfigure.
+    */
+    class CRuntimeFull
+    {
+    public:
+        CRuntimeFull(EFullMode fm = EFullMode::SKIP_LAST, bool skip_no_cons = true) : mode(fm), skip_if_no_consumer(skip_no_cons) {}
+
+        EFullMode Mode() const { return mode.load(std::memory_order_relaxed); }
+        bool SkipIfNoConsumer() const { return skip_if_no_consumer; }
+
+        /// \return true if the mode could be set by SetMode
+        bool Accepts(EFullMode) const { return true; }
+        void SetMode(EFullMode fm) { mode.store(fm, std::memory_order_relaxed); }
+
+    private:
+        std::atomic<EFullMode> mode;
+        bool skip_if_no_consumer;
+    };
+
+    /**
+        \brief Full policy of CPQueue fixed at compile time. The settings passed to the queue are ignored,
+         the checks of the mode on push and consume are constant, so the compiler drops the branches of other modes.
+         Reconfigure keeps the capacity only, it fails for another mode.
+    */
+    template<EFullMode FullMode, bool SkipNoConsumer = true>
+    class SFixedFull
+    {
+    public:
+        SFixedFull(EFullMode = FullMode, bool = SkipNoConsumer) {}
+
+        constexpr EFullMode Mode() const { return FullMode; }
+        constexpr bool SkipIfNoConsumer() const { return SkipNoConsumer; }
+
+        bool Accepts(EFullMode fm) const { return fm == FullMode; }
+        void SetMode(EFullMode) {}
+    };
+
+    template<bool SkipNoConsumer = true>
+    using SSkipLast = SFixedFull<EFullMode::SKIP_LAST, SkipNoConsumer>;
+
+    template<bool SkipNoConsumer = true>
+    using SDropFirst = SFixedFull<EFullMode::DROP_FIRST, SkipNoConsumer>;
+
+    template<bool SkipNoConsumer = true>
+    using SWaitFull = SFixedFull<EFullMode::WAIT, SkipNoConsumer>;
+
+    /// Reason why an element has not been delivered, see CPQueue::GetDropCount
+    enum class EDropReason : int
+    {
+        NO_CONSUMER, /// Element has been skipped because the queue had no consumer
+        QUEUE_FULL,  /// Element has been skipped because the queue was full in SKIP_LAST mode
+        EVICTED,     /// Element has been popped to free space for the new one in DROP_FIRST mode
+        EXPIRED,     /// Element has passed its deadline before it was dequeued
+        CONFLATED,   /// Element has been replaced by a newer one with the same conflation key
+        LOG_ERROR,   /// Element has been skipped because it couldn't be written to the durable or overflow log
+        COUNT
+    };
+
+    /// Result of one attempt of the processing thread to consume an element
+    enum class EConsumeResult : int
+    {
+        CONSUMED, /// Element has been passed to consumer
+        EMPTY,    /// Queue is empty or has no consumer
+        BUSY,     /// Queue is being consumed by another thread
+        THROTTLED /// Queue has elements but its rate limit doesn't allow to consume them now
+    };
+
+    /**
+        \brief Internal template which is is thread safe wrapper for the queue container.
+         It allows to associate certain consumer to the internal queue. ConsumerType could be any class
+         with Consume(const T&) method, the call is not virtual for a final class or a class without virtual Consume.
+         FullPolicy defines how the queue handles elements which it can't take, CRuntimeFull gives the queue
+         configured at runtime, SSkipLast, SDropFirst and SWaitFull fix the settings at compile time.
+    */
+    template<typename T, typename ConsumerType = IConsumer<T>, typename FullPolicy = CRuntimeFull>
+    class CPQueue : public CCacheLineAligned
+    {
+        typedef std::chrono::steady_clock Clock;
+        typedef Clock::time_point TimePoint;
+
+    public:
+
+        /**
+            \brief Internal interface to notify that the queue has received new element.
+        */
+        class ICPQNotifier
+        {
+        public:
+            ICPQNotifier() {}
+            virtual ~ICPQNotifier() {}
+            virtual void Notify() = 0;
+            /// Called under the queue lock when the queue has become empty or the outstanding counter has reached zero
+            virtual void Settled() {}
+        };
+
+    public:
+        /**
+             Constructor of the queue
+             \param [in] max_size - Max number of elements in queue.
+             \param [in] fm - value from EFullMode enum. It defines how the queue should work when it is full.
+             \param [in] skip_no_cons - boolean flag which says if the queue needs to skip elements in case of no consumer.
+             \param [in] notifier - pointer to object who need to know that the queue has received new element, it should be inherited from ICPNotifier interface. 
+        */
+        CPQueue(size_t max_size = MAX_CAPACITY,
+            EFullMode fm = EFullMode::SKIP_LAST,
+            bool skip_no_cons = true,
+            ICPQNotifier * notifier = nullptr) : CPQueue(MakeOptions(max_size, fm, skip_no_cons), notifier) {}
+
+        /**
+             Constructor of the queue
+             \param [in] options - settings of the queue, see SQueueOptions.
+             \param [in] notifier - pointer to object who need to know that the queue has received new element, it should be inherited from ICPNotifier interface.
+        */
+        CPQueue(const SQueueOptions<T>& options, ICPQNotifier * notifier = nullptr) : maxSize(options.capacity),
+            notifier(notifier),
+            full(options.full_mode, options.skip_if_no_consumer),
+            ttl(options.ttl),
+            conflation_key(options.conflation_key),
+            cpq(options.capacity, options.numa_node, options.numa_placement),
+            rate_limiter(options.rate_limit, options.rate_burst)
+        {
+            if (ttl > Clock::duration::zero())
+                EnsureDeadlines();
+            MQP_TRACE(stamps.reset(new CRingBuffer<uint64_t>(options.capacity));)
+
+            if (!options.persistence.path.empty())
+            {
+                // Elements which were not consumed before restart are loaded back to the queue
+                log.reset(new CSegmentLog(options.persistence, true));
+                persistent = true;
+            }
+            else if (full.Mode() == EFullMode::SPILL)
+            {
+                SLogOptions spill = options.spill;
+                if (spill.path.empty())
+                    spill.path = CMappedFile::TempPath("mqp_spill");
+                log.reset(new CSegmentLog(spill, false));
+            }
+
+            if (log)
+            {
+                // Elements in the log can't be replaced in place
+                ready = !conflation_key && CSerializer<T>::supported && log->Open();
+                if (ready)
+                    Refill();
+                else
+                    log.reset();
+            }
+        }
+
+        ~CPQueue()
+        {
+            SetOutstandingCounter(nullptr);
+        }
+
+        /**
+            \return false if the queue could not open its log or conflation is combined with a log, such queue should not be used.
+        */
+        bool IsReady() const
+        {
+            return ready;
+        }
+
+        /**
+            It sets certain consumer to process the queue.
+            \param [in] cons - pointer to consumer which inheritaed from IConsumer interface.
+        */
+        void SetConsumer(ConsumerType* cons)
+        {
+            std::lock_guard<std::mutex> loc(consumer_mtx);
+            consumer.store(cons);
+        }
+
+        /**
+            It sets certain consumer without waiting for the consume in progress, which could still call the old consumer.
+            The caller should keep the old consumer alive till such calls are over.
+            \param [in] cons - pointer to consumer which inheritaed from IConsumer interface.
+        */
+        void PublishConsumer(ConsumerType* cons)
+        {
+            consumer.store(cons);
+        }
+
+        /**
+            It sets the counter of elements which are kept by the queue, the counter could be shared by several queues.
+            Elements already kept by the queue are moved from the previous counter to the new one.
+            \param [in] counter - pointer to the counter or nullptr to stop counting.
+        */
+        void SetOutstandingCounter(std::atomic<int64_t>* counter)
+        {
+            std::lock_guard<std::mutex> loc(mtx);
+            Account(-static_cast<int64_t>(Count()));
+            outstanding = counter;
+            Account(static_cast<int64_t>(Count()));
+        }
+
+
+        /**
+            It push the new element to queue. Thread safe operation.
+            \param [in] value - element which should be placed to the queue.
+        */
+        void Push(const T& value)
+        {
+            PushRange(&value, &value + 1, TimePoint::max());
+        }
+
+        /**
+            It push the new element to queue with its own deadline. Thread safe operation.
+            The element is dropped at dequeue if the deadline or the queue ttl has passed.
+            \param [in] value - element which should be placed to the queue.
+            \param [in] deadline - time after which the element is not delivered.
+        */
+        void Push(const T& value, TimePoint deadline)
+        {
+            PushRange(&value, &value + 1, deadline);
+        }
+
+        /**
+            It push the new element to queue unless it would wait for room. Thread safe operation.
+            \param [in] value - element which should be placed to the queue.
+            \return false if the queue is full in WAIT mode and the element has not been taken, in other cases
+             the element is handled as by Push.
+        */
+        bool TryPush(const T& value)
+        {
+            bool would_wait = false;
+            PushRange(&value, &value + 1, TimePoint::max(), &would_wait);
+            return !would_wait;
+        }
+
+        /**
+            It push the range of elements to queue under one lock with one notification. Thread safe operation.
+            Each element is handled according to full mode in the same way as by Push.
+            \param [in] first, last - range of elements which should be placed to the queue.
+            \return number of elements which have been placed to the queue.
+        */
+        template<typename InputIt>
+        size_t PushBatch(InputIt first, InputIt last)
+        {
+            return PushRange(first, last, TimePoint::max());
+        }
+
+        /**
+            Pop the element from the queue and pass it to consumer.
+            \return true if element has been passed to consumer ot false in other way. 
+        */
+        bool Consume()
+        {
+            std::unique_lock<std::mutex> consumer_loc(consumer_mtx);
+            MQP_TRACE(trace_visit = CLatencyTracer::Now();)
+            TimePoint retry_at;
+            return ConsumeLocked(retry_at) == EConsumeResult::CONSUMED;
+        }
+
+        /**
+            Pop elements from the queue and pass them to consumer unless another thread is consuming the queue.
+            It allows several processing threads to share the queues, one queue is never consumed concurrently.
+            The queue lock is taken for each element, so producers are not blocked for the whole batch.
+            \param [out] retry_at - time when the queue could be consumed again, it is set for THROTTLED result only.
+            \param [in] max_count - max number of elements to pass.
+            \param [in] until - time after which no more elements are passed, the first element is passed anyway.
+            \return CONSUMED if at least one element has been passed or other value from EConsumeResult enum.
+        */
+        EConsumeResult TryConsume(TimePoint& retry_at, size_t max_count = 1, TimePoint until = TimePoint::max())
+        {
+            std::unique_lock<std::mutex> consumer_loc(consumer_mtx, std::try_to_lock);
+            if (!consumer_loc.owns_lock())
+                return EConsumeResult::BUSY;
+
+            MQP_TRACE(trace_visit = CLatencyTracer::Now();)
+            EConsumeResult result = ConsumeLocked(retry_at);
+            size_t count = result == EConsumeResult::CONSUMED ? 1 : 0;
+            while (result == EConsumeResult::CONSUMED && count < max_count && (until == TimePoint::max() || Clock::now() < until))
+            {
+                result = ConsumeLocked(retry_at);
+                if (result == EConsumeResult::CONSUMED)
+                    ++count;
+            }
+
+            return count > 0 ? EConsumeResult::CONSUMED : result;
+        }
+
+        /**
+            It enables measuring of each consumer call, calls which take longer than the threshold are counted as slow.
+            \param [in] threshold - max normal duration of consumer call, zero disables measuring.
+        */
+        void SetSlowConsumeThreshold(std::chrono::nanoseconds threshold)
+        {
+            std::lock_guard<std::mutex> loc(consumer_mtx);
+            slow_threshold = threshold;
+        }
+
+        /// \return number of consumer calls which took longer than the threshold, see SetSlowConsumeThreshold
+        uint64_t GetSlowConsumeCount() const
+        {
+            return slow_consumes.load(std::memory_order_relaxed);
+        }
+
+        /// \return duration of the last slow consumer call
+        std::chrono::nanoseconds GetLastSlowConsumeTime() const
+        {
+            return std::chrono::nanoseconds(last_slow_ns.load(std::memory_order_relaxed));
+        }
+
+        /**
+            It changes the rate limit of passing elements to consumer. Pop methods are not limited.
+            \param [in] rate - max number of elements per second, 0 removes the limit.
+            \param [in] burst - max number of elements passed at once.
+        */
+        void SetRateLimit(double rate, double burst = 1)
+        {
+            std::lock_guard<std::mutex> loc(consumer_mtx);
+            rate_limiter.Reset(rate, burst);
+        }
+
+        /**
+            Pop the element from the queue without passing it to consumer. Thread safe operation.
+            It allows to poll the queue from any thread instead of being called back by consumer.
+            \param [out] value - popped element.
+            \return true if element has been popped or false if the queue is empty.
+        */
+        bool TryPop(T& value)
+        {
+            std::unique_lock<std::mutex> loc(mtx);
+            if (DropExpired() > 0 && full.Mode() == EFullMode::WAIT)
+                cv.notify_all();
+            if (!FrontVisible())
+                return false;
+
+            PopFront(value, loc);
+            return true;
+        }
+
+        /**
+            Pop up to max_count elements from the queue under one lock. Thread safe operation.
+            \param [out] out - output iterator which receives popped elements in queue order.
+            \param [in] max_count - max number of elements to pop.
+            \return number of popped elements.
+        */
+        template<typename OutIt>
+        size_t PopBatch(OutIt out, size_t max_count)
+        {
+            std::unique_lock<std::mutex> loc(mtx);
+            const size_t expired = DropExpired();
+            size_t count = 0;
+            for (; count < max_count && FrontVisible(); ++count)
+            {
+                MQP_TRACE(CLatencyTracer::Record(ETraceStage::RESIDENCY, stamps->front(), CLatencyTracer::Now());)
+                *out = std::move(cpq.front());
+                ++out;
+                DropFront();
+            }
+
+            if (count > 0 && log)
+                log->Flush();
+
+            if (count + expired > 0 && full.Mode() == EFullMode::WAIT)
+            {
+                loc.unlock();
+                cv.notify_all();
+            }
+
+            return count;
+        }
+
+        /**
+            Wait till the queue gets an element and pop it. Thread safe operation.
+            \param [out] value - popped element.
+            \param [in] timeout - max time to wait for an element.
+            \return true if element has been popped or false if the timeout has expired.
+        */
+        template<typename Rep, typename Period>
+        bool WaitPop(T& value, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            std::unique_lock<std::mutex> loc(mtx);
+            ++pop_waiters;
+            size_t expired = 0;
+            const bool ready = pop_cv.wait_for(loc, timeout, [this, &expired]() { expired += DropExpired(); return FrontVisible(); });
+            --pop_waiters;
+            if (expired > 0 && full.Mode() == EFullMode::WAIT)
+                cv.notify_all();
+            if (!ready)
+                return false;
+
+            PopFront(value, loc);
+            return true;
+        }
+
+        /**
+            It drops expired elements from the front of the queue in one batch. Thread safe operation.
+            Elements with the same ttl expire in queue order, an element with a later own deadline
+            keeps the elements behind it till it is dequeued or expired.
+            \return number of dropped elements.
+        */
+        size_t Expire()
+        {
+            std::unique_lock<std::mutex> loc(mtx);
+            const size_t count = DropExpired();
+            loc.unlock();
+            if (count > 0 && full.Mode() == EFullMode::WAIT)
+            {
+                cv.notify_all();
+            }
+            return count;
+        }
+
+        /**
+            \param [in] reason - value from EDropReason enum.
+            \return number of elements which have not been delivered because of the reason.
+        */
+        uint64_t GetDropCount(EDropReason reason) const
+        {
+            return drops[static_cast<int>(reason)].load(std::memory_order_relaxed);
+        }
+
+        /**
+            It push the new element to queue. Thread safe operation.
+            \return number of elements in queue. 
+        */
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> loc(mtx);
+            return Count();
+        }
+
+        /**
+            It changes capacity and full mode of the queue keeping its elements. Thread safe operation.
+            Producers blocked in WAIT mode are woken up and handle the full queue according to the new mode.
+            \param [in] capacity - new max number of elements, it should not be less than the number of elements in memory.
+            \param [in] fm - value from EFullMode enum, SPILL needs the queue which has been created with a log,
+             the queue with a fixed full policy accepts its own mode only.
+            \return true if the queue has been reconfigured or false if it keeps the old settings.
+        */
+        bool Reconfigure(size_t capacity, EFullMode fm)
+        {
+            std::unique_lock<std::mutex> loc(mtx);
+            if (capacity == 0 || capacity < cpq.size() + reserved || (fm == EFullMode::SPILL && !log) || !full.Accepts(fm))
+                return false;
+
+            if (capacity != cpq.capacity())
+            {
+                cpq.reserve(capacity);
+                if (deadlines)
+                    deadlines->reserve(capacity);
+                if (seqs)
+                    seqs->reserve(capacity);
+                MQP_TRACE(stamps->reserve(capacity);)
+                if (log)
+                    Refill();
+            }
+            maxSize = capacity;
+            full.SetMode(fm);
+            loc.unlock();
+
+            cv.notify_all();
+            return true;
+        }
+
+        /**
+            It reserves room for elements which are put by PushReserved, reserved room is not used by other pushes.
+            Thread safe operation.
+            \param [in] count - number of elements.
+            \return false if the queue has not enough room, would skip elements because it has no consumer,
+             keeps elements in a log, which can't hide them, or conflates elements, which could replace the hidden one.
+        */
+        bool Reserve(size_t count)
+        {
+            std::lock_guard<std::mutex> loc(mtx);
+            if (log || conflation_key || (full.SkipIfNoConsumer() && consumer.load(std::memory_order_acquire) == nullptr))
+                return false;
+
+            DropExpired();
+            if (Count() + reserved + count > maxSize)
+                return false;
+
+            reserved += count;
+            return true;
+        }
+
+        /**
+            It releases the room reserved by Reserve and not used by PushReserved. Thread safe operation.
+            \param [in] count - number of elements.
+        */
+        void Unreserve(size_t count)
+        {
+            std::unique_lock<std::mutex> loc(mtx);
+            reserved -= count;
+            loc.unlock();
+            if (full.Mode() == EFullMode::WAIT)
+            {
+                cv.notify_all();
+            }
+        }
+
+        /**
+            It puts the element to the room reserved by Reserve. Thread safe operation.
+            The element and the elements behind it are not dequeued till the watermark reaches its sequence number,
+            so elements put to several queues become visible at once. The call doesn't notify, see NotifyVisible.
+            The queue ttl is applied to the element, it could expire before it becomes visible.
+            The reservation is kept if the call throws.
+            \param [in] value - element which should be placed to the queue.
+            \param [in] seq - sequence number of the element, it should be greater than 0.
+            \param [in] watermark - the greatest visible sequence number, it should be the same for all elements of the queue.
+        */
+        void PushReserved(const T& value, uint64_t seq, const std::atomic<uint64_t>& watermark)
+        {
+            const TimePoint deadline = ttl > Clock::duration::zero() ? Clock::now() + ttl : TimePoint::max();
+            std::lock_guard<std::mutex> loc(mtx);
+            assert(reserved > 0);
+            visible_seq = &watermark;
+            PushMemory(value, deadline, seq);
+            --reserved;
+            Account(1);
+        }
+
+        /**
+            It wakes up the processing thread and pollers after the watermark has been moved.
+        */
+        void NotifyVisible()
+        {
+            // Pollers check the watermark under mtx, so the lock orders the check before the notification
+            std::unique_lock<std::mutex> loc(mtx);
+            const bool waiters = pop_waiters > 0;
+            loc.unlock();
+
+            if (waiters)
+                pop_cv.notify_all();
+            if (notifier)
+                notifier->Notify();
+        }
+
+        /**
+            It cleares the queue.
+        */
+        void Clear()
+        {
+            std::unique_lock<std::mutex> loc(mtx);
+            const size_t count = Count();
+            cpq.clear();
+            if (deadlines)
+                deadlines->clear();
+            if (seqs)
+                seqs->clear();
+            MQP_TRACE(stamps->clear();)
+            conflation_index.clear();
+            if (log)
+            {
+                log->CommitAll();
+                log->Flush();
+            }
+            Account(-static_cast<int64_t>(count));
+            loc.unlock();
+            if (full.Mode() == EFullMode::WAIT)
+            {
+                cv.notify_all();
+            }
+        }
+
+    private:
+        // If would_wait is set, the push stops at the element which would wait for room in WAIT mode and sets the flag
+        template<typename InputIt>
+        size_t PushRange(InputIt first, InputIt last, TimePoint deadline, bool* would_wait = nullptr)
+        {
+            if (full.SkipIfNoConsumer() && consumer.load(std::memory_order_acquire) == nullptr)
+            {
+                AddDrops(EDropReason::NO_CONSUMER, static_cast<size_t>(std::distance(first, last)));
+                return 0;
+            }
+
+            if (ttl > Clock::duration::zero())
+                deadline = std::min(deadline, Clock::now() + ttl);
+
+            MQP_TRACE(const uint64_t trace_lock = CLatencyTracer::Now();)
+            std::unique_lock<std::mutex> loc(mtx);
+            MQP_TRACE(CLatencyTracer::Record(ETraceStage::LOCK_WAIT, trace_lock, CLatencyTracer::Now());)
+            size_t count = 0;
+            for (; first != last && !(would_wait && *would_wait); ++first)
+            {
+                if (PushLocked(*first, deadline, loc, would_wait))
+                    ++count;
+            }
+
+            if (count == 0)
+                return 0;
+
+            if (log)
+                log->Flush();
+            const bool has_pop_waiters = pop_waiters > 0;
+            loc.unlock();
+
+            if (has_pop_waiters)
+                pop_cv.notify_all();
+
+            if (notifier)
+                notifier->Notify();
+
+            return count;
+        }
+
+        // Passes the front element to consumer. Should be called under consumer_mtx.
+        EConsumeResult ConsumeLocked(TimePoint& retry_at)
+        {
+            ConsumerType* const cons = consumer.load(std::memory_order_acquire);
+            if (cons == nullptr)
+                return EConsumeResult::EMPTY;
+
+            std::unique_lock<std::mutex> q_loc(mtx);
+            if (DropExpired() > 0 && full.Mode() == EFullMode::WAIT)
+                cv.notify_all();
+            if (!FrontVisible())
+                return EConsumeResult::EMPTY;
+
+            if (rate_limiter.IsLimited())
+            {
+                const TimePoint now = Clock::now();
+                if (!rate_limiter.TryAcquire(now))
+                {
+                    retry_at = rate_limiter.NextAvailable(now);
+                    return EConsumeResult::THROTTLED;
+                }
+            }
+
+            MQP_TRACE(const uint64_t trace_start = CLatencyTracer::Now();)
+            MQP_TRACE(CLatencyTracer::Record(ETraceStage::RESIDENCY, stamps->front(), trace_visit);)
+            MQP_TRACE(CLatencyTracer::Record(ETraceStage::DISPATCH, trace_visit, trace_start);)
+            MQP_EVENT(ETraceEvent::CONSUME_BEGIN, this);
+            if (slow_threshold.count() > 0)
+            {
+                const TimePoint start = Clock::now();
+                cons->Consume(cpq.front());
+                const std::chrono::nanoseconds duration = Clock::now() - start;
+                if (duration > slow_threshold)
+                {
+                    last_slow_ns.store(duration.count(), std::memory_order_relaxed);
+                    slow_consumes.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            else
+            {
+                cons->Consume(cpq.front());
+            }
+            MQP_EVENT(ETraceEvent::CONSUME_END, this);
+            MQP_TRACE(CLatencyTracer::Record(ETraceStage::CONSUME, trace_start, CLatencyTracer::Now());)
+            DropFront();
+            if (log)
+                log->Flush();
+            q_loc.unlock();
+
+            if (full.Mode() == EFullMode::WAIT)
+            {
+                cv.notify_all();
+            }
+
+            return EConsumeResult::CONSUMED;
+        }
+
+        // Moves the front element to value and wakes producers blocked in WAIT mode. Releases the lock.
+        void PopFront(T& value, std::unique_lock<std::mutex>& loc)
+        {
+            MQP_TRACE(CLatencyTracer::Record(ETraceStage::RESIDENCY, stamps->front(), CLatencyTracer::Now());)
+            value = std::move(cpq.front());
+            DropFront();
+            if (log)
+                log->Flush();
+            loc.unlock();
+
+            if (full.Mode() == EFullMode::WAIT)
+            {
+                cv.notify_all();
+            }
+        }
+
+        static SQueueOptions<T> MakeOptions(size_t max_size, EFullMode fm, bool skip_no_cons)
+        {
+            SQueueOptions<T> options;
+            options.capacity = max_size;
+            options.full_mode = fm;
+            options.skip_if_no_consumer = skip_no_cons;
+            return options;
+        }
+
+        // Handles full queue according to full mode and pushes the element. Should be called under mtx.
+        // Instead of waiting in WAIT mode it sets would_wait if the pointer is given.
+        bool PushLocked(const T& value, TimePoint deadline, std::unique_lock<std::mutex>& loc, bool* would_wait)
+        {
+            if (conflation_key && Conflate(value, deadline))
+                return true;
+
+            // The queue could be reconfigured while the producer waits, so the full queue is handled again after the wait
+            for (;;)
+            {
+                const EFullMode mode = full.Mode();
+                bool is_full = mode != EFullMode::SPILL && Count() + reserved >= maxSize;
+                if (is_full && DropExpired() > 0)
+                {
+                    is_full = Count() + reserved >= maxSize;
+                }
+
+                if (!is_full)
+                    break;
+
+                if (mode == EFullMode::SKIP_LAST)
+                {
+                    AddDrops(EDropReason::QUEUE_FULL, 1);
+                    return false;
+                }
+                else if (mode == EFullMode::DROP_FIRST)
+                {
+                    // The room could be taken by reservations only, or the front element could be put by PushReserved
+                    // and not be visible yet. Hidden element is not evicted, the new one is skipped as in SKIP_LAST mode
+                    if (!FrontVisible())
+                    {
+                        AddDrops(EDropReason::QUEUE_FULL, 1);
+                        return false;
+                    }
+                    DropFront();
+                    AddDrops(EDropReason::EVICTED, 1);
+                    break;
+                }
+                else if (mode == EFullMode::WAIT)
+                {
+                    if (would_wait)
+                    {
+                        *would_wait = true;
+                        return false;
+                    }
+
+                    MQP_EVENT(ETraceEvent::BLOCK_BEGIN, this);
+                    cv.wait(loc, [this]() { return Count() + reserved < maxSize || full.Mode() != EFullMode::WAIT; });
+                    MQP_EVENT(ETraceEvent::BLOCK_END, this);
+                }
+                else
+                    assert(false);
+            }
+
+            return PushBack(value, deadline);
+        }
+
+        // Number of elements in memory and in the log. Should be called under mtx.
+        size_t Count() const
+        {
+            return cpq.size() + (log ? log->Pending() : 0);
+        }
+
+        // Appends the element to the durable log or to the overflow log if memory is full,
+        // it is kept in memory if it is the next one to consume. Returns false if the log has failed to take the element.
+        bool PushBack(const T& value, TimePoint deadline)
+        {
+            const bool loaded = !log || (log->Pending() == 0 && cpq.size() < cpq.capacity());
+            if (loaded && !persistent)
+            {
+                PushMemory(value, deadline);
+                Account(1);
+                return true;
+            }
+
+            CSerializer<T>::Serialize(value, log_buffer);
+            if (!log->Append(log_buffer.data(), log_buffer.size(), ToMeta(deadline), loaded))
+            {
+                AddDrops(EDropReason::LOG_ERROR, 1);
+                return false;
+            }
+
+            if (loaded)
+                PushMemory(value, deadline);
+            Account(1);
+            return true;
+        }
+
+        // Updates the outstanding counter. Decrement is released, so the thread which sees zero sees the consumes too.
+        // Waiters for the counter or for the empty queue are woken up on the decrement which makes it so. Should be called under mtx.
+        void Account(int64_t delta)
+        {
+            if (outstanding && delta != 0)
+            {
+                const int64_t before = outstanding->fetch_add(delta, std::memory_order_acq_rel);
+                assert(before + delta >= 0);
+                if (delta < 0 && notifier && (before + delta == 0 || Count() == 0))
+                    notifier->Settled();
+            }
+        }
+
+        template<typename V>
+        void PushMemory(V&& value, TimePoint deadline, uint64_t seq = 0)
+        {
+            if (deadline != TimePoint::max())
+                EnsureDeadlines();
+            if (seq != 0)
+                EnsureSeqs();
+            if (conflation_key)
+                conflation_index[conflation_key(value)] = head_seq + cpq.size();
+            cpq.push(std::forward<V>(value));
+            if (deadlines)
+                deadlines->push(deadline);
+            if (seqs)
+                seqs->push(seq);
+            MQP_TRACE(stamps->push(CLatencyTracer::Now());)
+        }
+
+        // Replaces queued element with the same conflation key keeping its position. Should be called under mtx.
+        bool Conflate(const T& value, TimePoint deadline)
+        {
+            const auto it = conflation_index.find(conflation_key(value));
+            if (it == conflation_index.end())
+                return false;
+
+            const size_t pos = static_cast<size_t>(it->second - head_seq);
+            cpq[pos] = value;
+            if (deadline != TimePoint::max())
+                EnsureDeadlines();
+            if (deadlines)
+                (*deadlines)[pos] = deadline;
+            MQP_TRACE((*stamps)[pos] = CLatencyTracer::Now();)
+
+            AddDrops(EDropReason::CONFLATED, 1);
+            return true;
+        }
+
+        // Deadlines are kept in the parallel ring which is allocated with the first element which has a deadline.
+        void EnsureDeadlines()
+        {
+            if (deadlines)
+                return;
+
+            deadlines.reset(new CRingBuffer<TimePoint>(cpq.capacity()));
+            for (size_t i = 0; i < cpq.size(); ++i)
+                deadlines->push(TimePoint::max());
+        }
+
+        // Sequence numbers are kept in the parallel ring which is allocated with the first element put by PushReserved.
+        void EnsureSeqs()
+        {
+            if (seqs)
+                return;
+
+            seqs.reset(new CRingBuffer<uint64_t>(cpq.capacity()));
+            for (size_t i = 0; i < cpq.size(); ++i)
+                seqs->push(0);
+        }
+
+        // \return true if the queue has the front element and its sequence number is under the watermark. Should be called under mtx.
+        bool FrontVisible() const
+        {
+            if (cpq.empty())
+                return false;
+            return !seqs || seqs->front() <= visible_seq->load(std::memory_order_acquire);
+        }
+
+        // Drops expired elements from the front. Should be called under mtx.
+        size_t DropExpired()
+        {
+            if (!deadlines || deadlines->empty())
+                return 0;
+
+            const TimePoint now = Clock::now();
+            size_t count = 0;
+            while (!deadlines->empty() && deadlines->front() <= now)
+            {
+                DropFront();
+                ++count;
+            }
+
+            AddDrops(EDropReason::EXPIRED, count);
+            return count;
+        }
+
+        void AddDrops(EDropReason reason, size_t count)
+        {
+            if (count > 0)
+                drops[static_cast<int>(reason)].fetch_add(count, std::memory_order_relaxed);
+        }
+
+        // Log records keep deadline as system clock nanoseconds, so it stays valid after restart. Zero means no deadline.
+        static uint64_t ToMeta(TimePoint deadline)
+        {
+            if (deadline == TimePoint::max())
+                return 0;
+
+            const auto system_deadline = std::chrono::system_clock::now()
+                + std::chrono::duration_cast<std::chrono::system_clock::duration>(deadline - Clock::now());
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(system_deadline.time_since_epoch()).count();
+            return ns > 0 ? static_cast<uint64_t>(ns) : 1;
+        }
+
+        static TimePoint FromMeta(uint64_t meta)
+        {
+            if (meta == 0)
+                return TimePoint::max();
+
+            const auto system_deadline = std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(meta)));
+            return Clock::now() + std::chrono::duration_cast<Clock::duration>(system_deadline - std::chrono::system_clock::now());
+        }
+
+        // Removes the front element from memory, commits it in the log and loads the next elements from the log.
+        void DropFront()
+        {
+            if (conflation_key)
+            {
+                const auto it = conflation_index.find(conflation_key(cpq.front()));
+                if (it != conflation_index.end() && it->second == head_seq)
+                    conflation_index.erase(it);
+                ++head_seq;
+            }
+
+            cpq.pop();
+            if (deadlines)
+                deadlines->pop();
+            if (seqs)
+                seqs->pop();
+            MQP_TRACE(stamps->pop();)
+            Account(-1);
+            if (log)
+            {
+                log->Commit();
+                Refill();
+            }
+        }
+
+        void Refill()
+        {
+            Refill(std::integral_constant<bool, CSerializer<T>::supported>());
+        }
+
+        void Refill(std::false_type) {}
+
+        void Refill(std::true_type)
+        {
+            uint64_t meta = 0;
+            while (cpq.size() < cpq.capacity() && log->Peek(log_buffer, meta))
+            {
+                T value;
+                if (CSerializer<T>::Deserialize(log_buffer.data(), log_buffer.size(), value))
+                {
+                    PushMemory(std::move(value), FromMeta(meta));
+                    log->Skip();
+                }
+                else if (cpq.empty())
+                {
+                    // Broken record is committed when all elements before it are consumed
+                    log->Skip();
+                    log->Commit();
+                    Account(-1);
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+
+    private:
+        // The members are grouped by the side which writes them, each group starts a new cache line.
+        // Read-mostly configuration, written on construction. Capacity and full mode are also written by Reconfigure
+        // under mtx, full mode is read after unlock to wake up producers.
+        MQP_CACHE_ALIGNED size_t maxSize;
+        ICPQNotifier* notifier;
+        FullPolicy full;
+        bool persistent = false;
+        bool ready = true;
+        Clock::duration ttl;
+        std::function<uint64_t(const T&)> conflation_key;
+
+        // Queue state, written by producers and by consumer under mtx.
+        MQP_CACHE_ALIGNED mutable std::mutex mtx;
+        CRingBuffer<T> cpq;
+        size_t pop_waiters = 0;
+        std::unique_ptr<CSegmentLog> log;
+        std::string log_buffer;
+        std::unique_ptr<CRingBuffer<TimePoint>> deadlines;
+        MQP_TRACE(std::unique_ptr<CRingBuffer<uint64_t>> stamps;) // push time of elements, see CLatencyTracer
+        std::unordered_map<uint64_t, uint64_t> conflation_index; // conflation key -> sequence number of queued element
+        uint64_t head_seq = 0;                                   // sequence number of the front element
+        std::atomic<int64_t>* outstanding = nullptr;             // counter of kept elements, see SetOutstandingCounter
+        size_t reserved = 0;                                     // room reserved for PushReserved
+        std::unique_ptr<CRingBuffer<uint64_t>> seqs;             // sequence numbers of elements put by PushReserved, 0 for others
+        const std::atomic<uint64_t>* visible_seq = nullptr;      // watermark of PushReserved, set with the first such element
+
+        // Wait side, touched only when producers block in WAIT mode or pollers block in WaitPop.
+        MQP_CACHE_ALIGNED std::condition_variable cv;
+        std::condition_variable pop_cv;
+
+        // Consumer side, written by Subscribe/Unsubscribe and held by the processing thread.
+        MQP_CACHE_ALIGNED std::mutex consumer_mtx;
+        std::atomic<ConsumerType*> consumer{ nullptr };
+        CTokenBucket rate_limiter;
+        std::chrono::nanoseconds slow_threshold{ 0 };
+        MQP_TRACE(uint64_t trace_visit = 0;) // start of the current visit of the processing thread
+
+        // Statistics, updated by any side with relaxed increments.
+        MQP_CACHE_ALIGNED std::atomic<uint64_t> drops[static_cast<int>(EDropReason::COUNT)] = {};
+        std::atomic<uint64_t> slow_consumes{ 0 };
+        std::atomic<int64_t> last_slow_ns{ 0 };
+    };
+
+} // end namespace MultyQueueProcessor
+
+#endif
@@ -0,0 +1,34 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __ConsumerFunction_H__
+#define __ConsumerFunction_H__
+
+#include <utility>
+#include "CPQueue.h"
+
+namespace MultyQueueProcessor
+{
+    /**
+        \brief Consumer which calls the callable object. The class is final and keeps the callable by value,
+         so the call of the callable is inlined to Consume.
+    */
+    template<typename T, typename F>
+    class CCallableConsumer final : public IConsumer<T>
+    {
+    public:
+        template<typename U>
+        explicit CCallableConsumer(U&& callable) : function(std::forward<U>(callable)) {}
+
+        void Consume(const T& value) override
+        {
+            function(value);
+        }
+
+    private:
+        F function;
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __ConsumerFunction_H__
@@ -0,0 +1,231 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __EventTrace_H__
+#define __EventTrace_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <ostream>
+
+// Event trace is compiled in only with MQP_ENABLE_EVENT_TRACE defined, in other case MQP_EVENT expands to nothing
+#ifdef MQP_ENABLE_EVENT_TRACE
+#define MQP_EVENT(...) ::MultyQueueProcessor::CEventTrace::Record(__VA_ARGS__)
+#else
+#define MQP_EVENT(...)
+#endif
+
+// Number of events kept per thread, it should be a power of two
+#ifndef MQP_EVENT_TRACE_CAPACITY
+#define MQP_EVENT_TRACE_CAPACITY 16384
+#endif
+
+namespace MultyQueueProcessor
+{
+    /// Events of the processor activity, see CEventTrace
+    enum class ETraceEvent : int
+    {
+        SLEEP_BEGIN,   /// Processing thread starts to wait for elements
+        SLEEP_END,     /// Processing thread wakes up
+        VISIT_BEGIN,   /// Processing thread starts the visit of a queue
+        VISIT_END,     /// Processing thread ends the visit of a queue
+        CONSUME_BEGIN, /// Consumer call starts
+        CONSUME_END,   /// Consumer call ends
+        BLOCK_BEGIN,   /// Producer blocks on full queue in WAIT mode
+        BLOCK_END,     /// Producer continues after the block
+        QUEUE_CREATE,  /// Queue has been created
+        QUEUE_DELETE,  /// Queue has been deleted
+        COUNT
+    };
+
+    /**
+        \brief In-memory trace of the processor activity which could be written as Chrome trace JSON
+         (chrome://tracing, Perfetto). Each thread writes to its own ring of MQP_EVENT_TRACE_CAPACITY events,
+         the oldest events are overwritten. Recording takes one clock read and a few relaxed stores.
+         The ring of an exited thread is dumped once more and then given to the next new thread.
+    */
+    class CEventTrace
+    {
+        static const uint64_t CAPACITY = MQP_EVENT_TRACE_CAPACITY;
+        static_assert((CAPACITY & (CAPACITY - 1)) == 0, "MQP_EVENT_TRACE_CAPACITY should be a power of two");
+
+        // Fields are relaxed atomics, the sequence tells the reader if the event has been overwritten while it was read
+        struct SEvent
+        {
+            std::atomic<uint64_t> seq{ 0 };
+            std::atomic<uint64_t> time{ 0 };
+            std::atomic<uint64_t> type{ 0 };
+            std::atomic<uint64_t> queue{ 0 };
+            std::atomic<uint64_t> key{ 0 };
+        };
+
+        struct SThreadRing
+        {
+            uint64_t tid = 0;
+            std::atomic<uint64_t> head{ 0 };
+            SEvent events[CAPACITY];
+        };
+
+    public:
+        /**
+            It records the event to the ring of the calling thread.
+            \param [in] type - value from ETraceEvent enum.
+            \param [in] queue - address of the queue, if the event is related to a queue.
+            \param [in] key - hash of the queue key, if it is known.
+        */
+        static void Record(ETraceEvent type, const void* queue = nullptr, uint64_t key = 0)
+        {
+            thread_local SRingOwner owner;
+            SThreadRing* ring = owner.ring;
+            const uint64_t index = ring->head.load(std::memory_order_relaxed);
+            SEvent& event = ring->events[index & (CAPACITY - 1)];
+            event.seq.store(index * 2 + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            event.time.store(Now(), std::memory_order_relaxed);
+            event.type.store(static_cast<uint64_t>(type), std::memory_order_relaxed);
+            event.queue.store(reinterpret_cast<uintptr_t>(queue), std::memory_order_relaxed);
+            event.key.store(key, std::memory_order_relaxed);
+            event.seq.store(index * 2 + 2, std::memory_order_release);
+            ring->head.store(index + 1, std::memory_order_release);
+        }
+
+        /**
+            It writes events of all threads as Chrome trace JSON. It could be called while events are recorded.
+            \param [in] out - output stream.
+        */
+        static void DumpChromeTrace(std::ostream& out)
+        {
+            static const char* const names[] = { "sleep", "sleep", "visit", "visit", "consume", "consume",
+                "blocked", "blocked", "create", "delete" };
+            static const char* const phases[] = { "B", "E", "B", "E", "B", "E", "B", "E", "i", "i" };
+
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            out << "{\"traceEvents\":[";
+            bool first = true;
+            for (const auto& ring : registry.threads)
+            {
+                const uint64_t head = ring->head.load(std::memory_order_acquire);
+                const uint64_t begin = head > CAPACITY ? head - CAPACITY : 0;
+                for (uint64_t index = begin; index < head; ++index)
+                {
+                    const SEvent& event = ring->events[index & (CAPACITY - 1)];
+                    if (event.seq.load(std::memory_order_acquire) != index * 2 + 2)
+                        continue;
+
+                    const uint64_t time = event.time.load(std::memory_order_relaxed);
+                    const uint64_t type = event.type.load(std::memory_order_relaxed);
+                    const uint64_t queue = event.queue.load(std::memory_order_relaxed);
+                    const uint64_t key = event.key.load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (event.seq.load(std::memory_order_relaxed) != index * 2 + 2 || type >= static_cast<uint64_t>(ETraceEvent::COUNT))
+                        continue;
+
+                    out << (first ? "" : ",") << "\n{\"name\":\"" << names[type] << "\",\"ph\":\"" << phases[type]
+                        << "\",\"ts\":" << time / 1000 << '.' << (time % 1000) / 100 << (time % 100) / 10 << time % 10
+                        << ",\"pid\":1,\"tid\":" << ring->tid;
+                    if (phases[type][0] == 'i')
+                        out << ",\"s\":\"t\"";
+                    if (queue != 0)
+                        out << ",\"args\":{\"queue\":\"0x" << std::hex << queue << std::dec << "\",\"key\":" << key << '}';
+                    out << '}';
+                    first = false;
+                }
+            }
+            out << "\n]}\n";
+            ReuseFinished(registry);
+        }
+
+        /// It drops recorded events of all threads
+        static void Reset()
+        {
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            for (const auto& ring : registry.threads)
+                for (auto& event : ring->events)
+                    event.seq.store(0, std::memory_order_relaxed);
+            ReuseFinished(registry);
+        }
+
+    private:
+        struct SRegistry
+        {
+            std::mutex mtx;
+            std::vector<std::unique_ptr<SThreadRing>> threads;
+            std::vector<SThreadRing*> finished; // rings of exited threads, kept till the next dump
+            std::vector<SThreadRing*> spare;    // empty rings which new threads take before allocating
+            uint64_t last_tid = 0;
+        };
+
+        // Owner of the ring of one thread, it hands the ring back when the thread exits
+        struct SRingOwner
+        {
+            SThreadRing* ring = Acquire();
+
+            ~SRingOwner()
+            {
+                Release(ring);
+            }
+        };
+
+        static uint64_t Now()
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        static SRegistry& GetRegistry()
+        {
+            static SRegistry registry;
+            return registry;
+        }
+
+        // New thread takes a spare ring if there is one, so the memory is bounded by the number of live threads
+        static SThreadRing* Acquire()
+        {
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            SThreadRing* ring = nullptr;
+            if (registry.spare.empty())
+            {
+                registry.threads.emplace_back(new SThreadRing());
+                ring = registry.threads.back().get();
+            }
+            else
+            {
+                ring = registry.spare.back();
+                registry.spare.pop_back();
+            }
+            ring->tid = ++registry.last_tid;
+            return ring;
+        }
+
+        // Events of the exited thread are still dumped once, the ring is reused after that
+        static void Release(SThreadRing* ring)
+        {
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            registry.finished.push_back(ring);
+        }
+
+        // It clears rings of exited threads and makes them spare. Should be called under registry.mtx.
+        static void ReuseFinished(SRegistry& registry)
+        {
+            for (SThreadRing* ring : registry.finished)
+            {
+                for (auto& event : ring->events)
+                    event.seq.store(0, std::memory_order_relaxed);
+                ring->head.store(0, std::memory_order_relaxed);
+                registry.spare.push_back(ring);
+            }
+            registry.finished.clear();
+        }
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __EventTrace_H__
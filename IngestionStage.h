@@ -0,0 +1,308 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __IngestionStage_H__
+#define __IngestionStage_H__
+
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include "MultiQueueProcessor.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#define MQP_HAS_INGESTION 1
+#endif
+
+namespace MultyQueueProcessor
+{
+    /// Defines how the ingestion stage reads frames from the descriptor
+    enum class EIngestMode : int
+    {
+        STREAM,  /// Byte stream (stream socket or pipe), frames could be split between reads
+        DATAGRAM /// Datagram or seqpacket socket, each message contains whole frames only
+    };
+
+    /**
+        \brief Settings of the ingestion stage.
+    */
+    struct SIngestionOptions
+    {
+        EIngestMode mode = EIngestMode::STREAM; /// How frames are read from the descriptor
+        size_t buffer_size = 64 * 1024;         /// Size of the reusable read buffer, it limits the frame size in STREAM mode
+        size_t messages_per_read = 32;          /// Max number of datagrams received by one recvmmsg call
+        size_t max_batch = 1024;                /// Max number of decoded elements before they are enqueued
+    };
+
+    /**
+        \brief The CIngestionStage reads length-prefixed frames from a local socket or pipe in its own thread,
+               decodes key and value with the user codec and puts them to the processor in batches.
+               ProcessorType should provide size_t EnqueueBatch(KeyType id, InputIt first, InputIt last),
+               CMultiQueueProcessor with any consumer type or key policy fits.
+               Each frame is a 4 byte little-endian payload size followed by the payload.
+               Codec should provide bool Decode(const char* data, size_t size, KeyType& key, ValueType& value),
+               frames which are not decoded are counted and skipped. The descriptor is not closed by the stage.
+               It is implemented for POSIX systems only, on other platforms Start fails.
+    */
+    template<typename KeyType, typename ValueType, typename Codec, typename ProcessorType = CMultiQueueProcessor<KeyType, ValueType>>
+    class CIngestionStage
+    {
+        static const size_t FRAME_HEADER_SIZE = 4;
+
+    public:
+        /**
+            Constructor of the ingestion stage
+            \param [in] processor - processor which receives decoded elements.
+            \param [in] fd - descriptor of the socket or pipe to read from.
+            \param [in] options - settings of the stage, see SIngestionOptions.
+            \param [in] codec - decoder of frame payload.
+        */
+        CIngestionStage(ProcessorType& processor, int fd,
+            const SIngestionOptions& options = SIngestionOptions(), Codec codec = Codec())
+            : processor(processor), fd(fd), options(options), codec(codec) {}
+
+        ~CIngestionStage()
+        {
+            Stop();
+        }
+
+        CIngestionStage(const CIngestionStage&) = delete;
+        CIngestionStage& operator=(const CIngestionStage&) = delete;
+
+        /**
+            It starts internal thread which reads the descriptor till end of stream or Stop.
+            \return true if the thread has been started or false in other way.
+        */
+        bool Start()
+        {
+#ifdef MQP_HAS_INGESTION
+            if (th.joinable())
+                return false;
+
+            if (pipe(wake_pipe) != 0)
+                return false;
+
+            th = std::thread(std::bind(&CIngestionStage::Run, this));
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        /**
+            It stops internal thread and waits for it. Elements decoded before are enqueued.
+        */
+        void Stop()
+        {
+#ifdef MQP_HAS_INGESTION
+            if (!th.joinable())
+                return;
+
+            const char byte = 0;
+            ssize_t written = write(wake_pipe[1], &byte, 1);
+            (void)written;
+            th.join();
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+#endif
+        }
+
+        /// Number of frames which have been decoded and passed to the processor
+        uint64_t Received() const { return received.load(std::memory_order_relaxed); }
+
+        /// Number of frames which could not be decoded or were truncated
+        uint64_t Rejected() const { return rejected.load(std::memory_order_relaxed); }
+
+    protected:
+#ifdef MQP_HAS_INGESTION
+        void Run()
+        {
+            buffer.resize(options.buffer_size);
+            if (options.mode == EIngestMode::DATAGRAM)
+            {
+                // Buffers and message headers are set up once and reused by every recvmmsg
+                messages.resize(options.messages_per_read * options.buffer_size);
+                iov.resize(options.messages_per_read);
+                for (size_t i = 0; i < iov.size(); ++i)
+                {
+                    iov[i].iov_base = messages.data() + i * options.buffer_size;
+                    iov[i].iov_len = options.buffer_size;
+                }
+#ifdef __linux__
+                headers.resize(options.messages_per_read);
+#endif
+            }
+
+            pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
+            for (;;)
+            {
+                if (poll(fds, 2, -1) < 0)
+                    continue;
+
+                if (fds[1].revents != 0)
+                    break;
+
+                const bool more = options.mode == EIngestMode::STREAM ? ReadStream() : ReadDatagrams();
+                Flush();
+                if (!more)
+                    break;
+            }
+            Flush();
+        }
+
+        // One read gets as many frames as fit to the buffer, incomplete frame stays at the front of buffer
+        bool ReadStream()
+        {
+            const ssize_t n = read(fd, buffer.data() + buffered, buffer.size() - buffered);
+            if (n <= 0)
+                return n < 0 && (errno == EINTR || errno == EAGAIN);
+
+            buffered += static_cast<size_t>(n);
+            size_t pos = 0;
+            while (buffered - pos >= FRAME_HEADER_SIZE)
+            {
+                const size_t size = FrameSize(buffer.data() + pos);
+                if (FRAME_HEADER_SIZE + size > buffer.size())
+                {
+                    // The frame never fits to the buffer, the stream can't be synchronized anymore
+                    rejected.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+
+                if (buffered - pos < FRAME_HEADER_SIZE + size)
+                    break;
+
+                Decode(buffer.data() + pos + FRAME_HEADER_SIZE, size);
+                pos += FRAME_HEADER_SIZE + size;
+            }
+
+            buffered -= pos;
+            std::memmove(buffer.data(), buffer.data() + pos, buffered);
+            return true;
+        }
+
+        // One recvmmsg gets up to messages_per_read datagrams, each of them contains whole frames
+        bool ReadDatagrams()
+        {
+#ifdef __linux__
+            for (size_t i = 0; i < headers.size(); ++i)
+            {
+                std::memset(&headers[i], 0, sizeof(mmsghdr));
+                headers[i].msg_hdr.msg_iov = &iov[i];
+                headers[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            const int n = recvmmsg(fd, headers.data(), static_cast<unsigned>(headers.size()), MSG_DONTWAIT, nullptr);
+            if (n <= 0)
+                return n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+
+            for (int i = 0; i < n; ++i)
+            {
+                DecodeMessage(static_cast<const char*>(iov[i].iov_base), headers[i].msg_len);
+            }
+#else
+            const ssize_t n = recv(fd, iov[0].iov_base, iov[0].iov_len, 0);
+            if (n <= 0)
+                return n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+
+            DecodeMessage(static_cast<const char*>(iov[0].iov_base), static_cast<size_t>(n));
+#endif
+            return true;
+        }
+
+        void DecodeMessage(const char* data, size_t size)
+        {
+            size_t pos = 0;
+            while (size - pos >= FRAME_HEADER_SIZE)
+            {
+                const size_t frame = FrameSize(data + pos);
+                if (size - pos - FRAME_HEADER_SIZE < frame)
+                    break;
+
+                Decode(data + pos + FRAME_HEADER_SIZE, frame);
+                pos += FRAME_HEADER_SIZE + frame;
+            }
+
+            if (pos != size)
+                rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+#endif
+
+        static size_t FrameSize(const char* data)
+        {
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+            return static_cast<size_t>(bytes[0]) | (static_cast<size_t>(bytes[1]) << 8)
+                | (static_cast<size_t>(bytes[2]) << 16) | (static_cast<size_t>(bytes[3]) << 24);
+        }
+
+        void Decode(const char* data, size_t size)
+        {
+            KeyType key;
+            ValueType value;
+            if (!codec.Decode(data, size, key, value))
+            {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            pending[key].push_back(std::move(value));
+            if (++pending_count >= options.max_batch)
+                Flush();
+        }
+
+        // Elements of each key are enqueued by one EnqueueBatch call, vectors keep their memory for next batches
+        void Flush()
+        {
+            if (pending_count == 0)
+                return;
+
+            for (auto& batch : pending)
+            {
+                if (!batch.second.empty())
+                {
+                    processor.EnqueueBatch(batch.first, batch.second.begin(), batch.second.end());
+                    batch.second.clear();
+                }
+            }
+
+            received.fetch_add(pending_count, std::memory_order_relaxed);
+            pending_count = 0;
+        }
+
+    protected:
+        ProcessorType& processor;
+        int fd;
+        SIngestionOptions options;
+        Codec codec;
+
+        std::thread th;
+        int wake_pipe[2] = { -1, -1 };
+
+        std::vector<char> buffer;
+        size_t buffered = 0;
+        std::vector<char> messages;
+#ifdef MQP_HAS_INGESTION
+        std::vector<iovec> iov;
+#endif
+#ifdef __linux__
+        std::vector<mmsghdr> headers;
+#endif
+
+        std::unordered_map<KeyType, std::vector<ValueType>> pending;
+        size_t pending_count = 0;
+
+        std::atomic<uint64_t> received{ 0 };
+        std::atomic<uint64_t> rejected{ 0 };
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __IngestionStage_H__
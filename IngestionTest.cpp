@@ -0,0 +1,183 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#include <mutex>
+#include <vector>
+#include <string>
+#include <utility>
+#include "IngestionStage.h"
+#include "TestCheck.h"
+
+using namespace MultyQueueProcessor;
+
+namespace
+{
+    /// Payload is one byte of key followed by the value, empty payload is malformed
+    struct SByteKeyCodec
+    {
+        bool Decode(const char* data, size_t size, int& key, std::string& value)
+        {
+            if (size == 0)
+                return false;
+
+            key = static_cast<unsigned char>(data[0]);
+            value.assign(data + 1, size - 1);
+            return true;
+        }
+    };
+
+    std::string Frame(char key, const std::string& value)
+    {
+        const size_t size = value.size() + 1;
+        std::string frame;
+        frame.push_back(static_cast<char>(size & 0xFF));
+        frame.push_back(static_cast<char>((size >> 8) & 0xFF));
+        frame.push_back(static_cast<char>((size >> 16) & 0xFF));
+        frame.push_back(static_cast<char>((size >> 24) & 0xFF));
+        frame.push_back(key);
+        return frame + value;
+    }
+
+    /// Final consumer which is not derived from IConsumer, the processor calls it directly
+    class CStringCollector final
+    {
+    public:
+        void Consume(const std::string& value)
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            values.push_back(value);
+        }
+
+        std::vector<std::string> Values()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            return values;
+        }
+
+    private:
+        std::mutex mtx;
+        std::vector<std::string> values;
+    };
+
+    /// Processor stand-in which records the batches
+    class CRecordingProcessor
+    {
+    public:
+        template<typename InputIt>
+        size_t EnqueueBatch(int id, InputIt first, InputIt last)
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            size_t count = 0;
+            for (; first != last; ++first, ++count)
+                items.emplace_back(id, *first);
+            return count;
+        }
+
+        std::vector<std::pair<int, std::string>> Items()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            return items;
+        }
+
+    private:
+        std::mutex mtx;
+        std::vector<std::pair<int, std::string>> items;
+    };
+
+#ifdef MQP_HAS_INGESTION
+    template<typename Stage>
+    bool WaitFrames(const Stage& stage, uint64_t received, uint64_t rejected)
+    {
+        for (int i = 0; i < 500; ++i)
+        {
+            if (stage.Received() == received && stage.Rejected() == rejected)
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    void Send(int fd, const std::string& data)
+    {
+        MQP_CHECK(write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+    }
+
+    // Frame split between reads is joined, malformed payload is skipped, oversized frame stops the stream
+    void TestStream()
+    {
+        int fds[2];
+        MQP_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+        typedef CMultiQueueProcessor<int, std::string, CStringCollector> ProcessorType;
+        CStringCollector consumer;
+        ProcessorType processor;
+        MQP_CHECK(processor.CreateQueue('a'));
+        processor.Subscribe('a', &consumer).wait();
+
+        SIngestionOptions options;
+        options.buffer_size = 64;
+        CIngestionStage<int, std::string, SByteKeyCodec, ProcessorType> stage(processor, fds[0], options);
+        MQP_CHECK(stage.Start());
+
+        const std::string split = Frame('a', "second");
+        Send(fds[1], Frame('a', "first") + split.substr(0, 6));
+        MQP_CHECK(WaitFrames(stage, 1, 0));
+        Send(fds[1], split.substr(6));
+        MQP_CHECK(WaitFrames(stage, 2, 0));
+
+        Send(fds[1], std::string(4, '\0') + Frame('a', "third"));
+        MQP_CHECK(WaitFrames(stage, 3, 1));
+
+        Send(fds[1], std::string("\xff\x00\x00\x00", 4) + Frame('a', "lost"));
+        MQP_CHECK(WaitFrames(stage, 3, 2));
+        stage.Stop();
+
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<std::string>({ "first", "second", "third" }));
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    // Each datagram holds whole frames, a truncated frame rejects the rest of its datagram only
+    void TestDatagram()
+    {
+        int fds[2];
+        MQP_CHECK(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == 0);
+
+        CRecordingProcessor processor;
+        SIngestionOptions options;
+        options.mode = EIngestMode::DATAGRAM;
+        options.buffer_size = 256;
+        CIngestionStage<int, std::string, SByteKeyCodec, CRecordingProcessor> stage(processor, fds[0], options);
+        MQP_CHECK(stage.Start());
+
+        Send(fds[1], Frame('a', "one") + Frame('b', "two"));
+        Send(fds[1], Frame('a', "three") + Frame('b', "truncated").substr(0, 8));
+        Send(fds[1], std::string(4, '\0'));
+        Send(fds[1], Frame('b', "four"));
+        MQP_CHECK(WaitFrames(stage, 4, 2));
+        stage.Stop();
+
+        std::vector<std::string> a;
+        std::vector<std::string> b;
+        for (const auto& item : processor.Items())
+            (item.first == 'a' ? a : b).push_back(item.second);
+        MQP_CHECK(a == std::vector<std::string>({ "one", "three" }));
+        MQP_CHECK(b == std::vector<std::string>({ "two", "four" }));
+        close(fds[0]);
+        close(fds[1]);
+    }
+#endif
+}
+
+int main()
+{
+#ifdef MQP_HAS_INGESTION
+    TestStream();
+    TestDatagram();
+#endif
+
+    if (TestFailures() == 0)
+        std::cout << "all checks passed" << std::endl;
+    return TestFailures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __KeyRegistry_H__
+#define __KeyRegistry_H__
+
+#include <unordered_map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <type_traits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace MultyQueueProcessor
+{
+    /**
+        \brief Registry of queues for any hashable key. Queues are kept in the hash map guarded by the internal mutex,
+         subscribed keys are kept in the ordered set. Entries are shared, so a snapshot of subscribed queues keeps them
+         alive after Erase.
+         Activate, Deactivate and ForEachActive should be synchronized by the caller.
+    */
+    template<typename KeyType, typename EntryType>
+    class CHashRegistry
+    {
+    public:
+        /// \return true if the registry could keep the queue with the key
+        bool IsValidKey(KeyType) const
+        {
+            return true;
+        }
+
+        /// \return pointer to the queue entry or nullptr if there is no queue with the key
+        EntryType* Find(KeyType key) const
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            auto it = entries.find(key);
+            return it != entries.end() ? it->second.get() : nullptr;
+        }
+
+        /// \return false if there is a queue with the key already
+        bool Insert(KeyType key, std::shared_ptr<EntryType> entry)
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            return entries.emplace(key, std::move(entry)).second;
+        }
+
+        /// \return removed queue entry or nullptr if there is no queue with the key
+        std::shared_ptr<EntryType> Erase(KeyType key)
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            std::shared_ptr<EntryType> result;
+            auto it = entries.find(key);
+            if (it != entries.end())
+            {
+                result = std::move(it->second);
+                entries.erase(it);
+            }
+            return result;
+        }
+
+        /// It calls f(key, entry) for each queue
+        template<typename F>
+        void ForEach(F&& f) const
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            for (const auto& entry : entries)
+                f(entry.first, *entry.second);
+        }
+
+        void Activate(KeyType key)
+        {
+            active.insert(key);
+        }
+
+        void Deactivate(KeyType key)
+        {
+            active.erase(key);
+        }
+
+        /// It calls f(key, entry) for each subscribed key which has a queue, entry is the shared pointer
+        template<typename F>
+        void ForEachActive(F&& f) const
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            for (KeyType key : active)
+            {
+                auto it = entries.find(key);
+                if (it != entries.end())
+                    f(key, it->second);
+            }
+        }
+
+    private:
+        mutable std::mutex mtx;
+        std::unordered_map<KeyType, std::shared_ptr<EntryType>> entries;
+        std::set<KeyType> active;
+    };
+
+    /**
+        \brief Registry of queues for integral keys from 0 to N - 1. Queues are kept in the flat array of slots,
+         so Find is one atomic load without lock, subscribed keys are kept in the bitmap which is iterated in key order.
+         The slots own their entries by shared pointers, so a snapshot of subscribed queues keeps them alive after Erase.
+         Insert, Erase, ForEach and ForEachActive should be synchronized by the caller, as well as Activate and Deactivate.
+    */
+    template<typename KeyType, typename EntryType, size_t N>
+    class CDenseRegistry
+    {
+        static_assert(std::is_integral<KeyType>::value, "dense registry needs integral keys");
+
+        static const size_t WORDS = (N + 63) / 64;
+
+    public:
+        CDenseRegistry()
+        {
+            for (auto& slot : slots)
+                slot.store(nullptr, std::memory_order_relaxed);
+            for (auto& word : active)
+                word.store(0, std::memory_order_relaxed);
+        }
+
+        CDenseRegistry(const CDenseRegistry&) = delete;
+        CDenseRegistry& operator=(const CDenseRegistry&) = delete;
+
+        /// \return true if the key is in the range of the registry
+        bool IsValidKey(KeyType key) const
+        {
+            return static_cast<typename std::make_unsigned<KeyType>::type>(key) < N;
+        }
+
+        /// \return pointer to the queue entry or nullptr if there is no queue with the key
+        EntryType* Find(KeyType key) const
+        {
+            return IsValidKey(key) ? slots[Index(key)].load(std::memory_order_acquire) : nullptr;
+        }
+
+        /// \return false if there is a queue with the key already or the key is out of range
+        bool Insert(KeyType key, std::shared_ptr<EntryType> entry)
+        {
+            if (!IsValidKey(key) || owners[Index(key)])
+                return false;
+
+            owners[Index(key)] = std::move(entry);
+            slots[Index(key)].store(owners[Index(key)].get(), std::memory_order_release);
+            return true;
+        }
+
+        /// \return removed queue entry or nullptr if there is no queue with the key
+        std::shared_ptr<EntryType> Erase(KeyType key)
+        {
+            if (!IsValidKey(key))
+                return nullptr;
+
+            slots[Index(key)].store(nullptr, std::memory_order_release);
+            return std::move(owners[Index(key)]);
+        }
+
+        /// It calls f(key, entry) for each queue
+        template<typename F>
+        void ForEach(F&& f) const
+        {
+            for (size_t i = 0; i < N; ++i)
+            {
+                const EntryType* entry = slots[i].load(std::memory_order_acquire);
+                if (entry)
+                    f(static_cast<KeyType>(i), *entry);
+            }
+        }
+
+        void Activate(KeyType key)
+        {
+            if (IsValidKey(key))
+                active[Index(key) / 64].fetch_or(uint64_t(1) << (Index(key) % 64), std::memory_order_relaxed);
+        }
+
+        void Deactivate(KeyType key)
+        {
+            if (IsValidKey(key))
+                active[Index(key) / 64].fetch_and(~(uint64_t(1) << (Index(key) % 64)), std::memory_order_relaxed);
+        }
+
+        /// It calls f(key, entry) for each subscribed key which has a queue, entry is the shared pointer
+        template<typename F>
+        void ForEachActive(F&& f) const
+        {
+            for (size_t word = 0; word < WORDS; ++word)
+            {
+                uint64_t bits = active[word].load(std::memory_order_relaxed);
+                while (bits != 0)
+                {
+                    const size_t index = word * 64 + LowestBit(bits);
+                    bits &= bits - 1;
+                    if (owners[index])
+                        f(static_cast<KeyType>(index), owners[index]);
+                }
+            }
+        }
+
+    private:
+        static size_t Index(KeyType key)
+        {
+            return static_cast<size_t>(static_cast<typename std::make_unsigned<KeyType>::type>(key));
+        }
+
+        static size_t LowestBit(uint64_t bits)
+        {
+#ifdef _MSC_VER
+            unsigned long index = 0;
+            _BitScanForward64(&index, bits);
+            return index;
+#else
+            return static_cast<size_t>(__builtin_ctzll(bits));
+#endif
+        }
+
+    private:
+        std::atomic<EntryType*> slots[N];
+        std::shared_ptr<EntryType> owners[N];
+        std::atomic<uint64_t> active[WORDS];
+    };
+
+    /// Key policy of CMultiQueueProcessor for any hashable key, see CHashRegistry
+    struct SHashKeys
+    {
+        template<typename KeyType, typename EntryType>
+        using Registry = CHashRegistry<KeyType, EntryType>;
+    };
+
+    /// Key policy of CMultiQueueProcessor for integral keys from 0 to N - 1, see CDenseRegistry
+    template<size_t N>
+    struct SDenseKeys
+    {
+        template<typename KeyType, typename EntryType>
+        using Registry = CDenseRegistry<KeyType, EntryType, N>;
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __KeyRegistry_H__
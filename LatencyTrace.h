@@ -0,0 +1,288 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __LatencyTrace_H__
+#define __LatencyTrace_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+
+// Latency tracing is compiled in only with MQP_ENABLE_TRACING defined, in other case MQP_TRACE expands to nothing
+#ifdef MQP_ENABLE_TRACING
+#define MQP_TRACE(...) __VA_ARGS__
+#else
+#define MQP_TRACE(...)
+#endif
+
+namespace MultyQueueProcessor
+{
+    /// Stages of element delivery which are measured by the latency tracer
+    enum class ETraceStage : int
+    {
+        LOOKUP,    /// Search of the queue by key in Enqueue
+        LOCK_WAIT, /// Wait of the producer for the queue lock
+        RESIDENCY, /// Time in queue from push till the visit of the processing thread which consumes it, or till pop
+        DISPATCH,  /// Time from the start of that visit till the consumer call
+        CONSUME,   /// Duration of the consumer call
+        COUNT
+    };
+
+    /**
+        \brief Log-linear histogram of durations in nanoseconds with about 6% precision, like HDR histogram.
+         It has one writer, the counters are updated without read-modify-write, readers could run concurrently.
+    */
+    class CLatencyHistogram
+    {
+        static const unsigned SUB_BITS = 4;
+        static const uint64_t SUB_COUNT = uint64_t(1) << SUB_BITS;
+        static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    public:
+        CLatencyHistogram()
+        {
+            Reset();
+        }
+
+        void Record(uint64_t ns)
+        {
+            std::atomic<uint64_t>& counter = counts[Index(ns)];
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            if (ns > max.load(std::memory_order_relaxed))
+                max.store(ns, std::memory_order_relaxed);
+        }
+
+        void Reset()
+        {
+            for (auto& counter : counts)
+                counter.store(0, std::memory_order_relaxed);
+            max.store(0, std::memory_order_relaxed);
+        }
+
+        /// It adds counters of other histogram to this one
+        void Merge(const CLatencyHistogram& other)
+        {
+            for (size_t i = 0; i < BUCKETS; ++i)
+                counts[i].store(counts[i].load(std::memory_order_relaxed) + other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            if (other.max.load(std::memory_order_relaxed) > max.load(std::memory_order_relaxed))
+                max.store(other.max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
+        uint64_t Count() const
+        {
+            uint64_t total = 0;
+            for (const auto& counter : counts)
+                total += counter.load(std::memory_order_relaxed);
+            return total;
+        }
+
+        uint64_t Max() const
+        {
+            return max.load(std::memory_order_relaxed);
+        }
+
+        /**
+            \param [in] percentile - value from 0 to 100.
+            \return upper bound of the bucket which contains the percentile, in nanoseconds.
+        */
+        uint64_t Percentile(double percentile) const
+        {
+            const uint64_t total = Count();
+            if (total == 0)
+                return 0;
+
+            const uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(total - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i)
+            {
+                seen += counts[i].load(std::memory_order_relaxed);
+                if (seen >= rank)
+                    return std::min(UpperBound(i), Max());
+            }
+            return Max();
+        }
+
+    private:
+        // Values below SUB_COUNT have own buckets, the others are split by the highest bit and SUB_BITS bits after it
+        static size_t Index(uint64_t ns)
+        {
+            if (ns < SUB_COUNT)
+                return static_cast<size_t>(ns);
+
+            unsigned msb = 63;
+            while ((ns >> msb) == 0)
+                --msb;
+            const unsigned shift = msb - SUB_BITS;
+            return static_cast<size_t>((shift + 1) * SUB_COUNT + ((ns >> shift) & (SUB_COUNT - 1)));
+        }
+
+        static uint64_t UpperBound(size_t index)
+        {
+            if (index < SUB_COUNT)
+                return index;
+
+            const unsigned shift = static_cast<unsigned>(index / SUB_COUNT - 1);
+            const uint64_t mantissa = SUB_COUNT + index % SUB_COUNT;
+            return ((mantissa + 1) << shift) - 1;
+        }
+
+    private:
+        std::atomic<uint64_t> counts[BUCKETS];
+        std::atomic<uint64_t> max;
+    };
+
+    /**
+        \brief Collector of per-stage latencies. Each thread records to its own histograms, which are registered
+         on its first record. Histograms of an exited thread are kept till the next Dump or Reset, after that
+         they are cleared and given to the next new thread. Durations are measured with steady_clock.
+    */
+    class CLatencyTracer
+    {
+        struct SThreadHistograms
+        {
+            CLatencyHistogram stages[static_cast<int>(ETraceStage::COUNT)];
+        };
+
+    public:
+        /// \return current time in nanoseconds
+        static uint64_t Now()
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        /**
+            It records duration of the stage to the histogram of the calling thread.
+            \param [in] stage - value from ETraceStage enum.
+            \param [in] start, end - bounds of the stage returned by Now.
+        */
+        static void Record(ETraceStage stage, uint64_t start, uint64_t end)
+        {
+            thread_local SHistogramsOwner owner;
+            owner.local->stages[static_cast<int>(stage)].Record(end > start ? end - start : 0);
+        }
+
+        /**
+            \param [in] stage - value from ETraceStage enum.
+            \return histogram of the stage merged from all threads.
+        */
+        static std::unique_ptr<CLatencyHistogram> Collect(ETraceStage stage)
+        {
+            std::unique_ptr<CLatencyHistogram> result(new CLatencyHistogram());
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            for (const auto& histograms : registry.threads)
+                result->Merge(histograms->stages[static_cast<int>(stage)]);
+            return result;
+        }
+
+        /// It clears histograms of all threads
+        static void Reset()
+        {
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            for (const auto& histograms : registry.threads)
+                for (auto& histogram : histograms->stages)
+                    histogram.Reset();
+            registry.spare.insert(registry.spare.end(), registry.finished.begin(), registry.finished.end());
+            registry.finished.clear();
+        }
+
+        /**
+            It writes count, percentiles and max of each stage in nanoseconds as text table.
+            \param [in] out - output stream.
+        */
+        static void Dump(std::ostream& out)
+        {
+            static const char* const names[] = { "lookup", "lock_wait", "residency", "dispatch", "consume" };
+            // Only threads which have exited before the dump started are surely in all stages
+            size_t finished = 0;
+            {
+                SRegistry& registry = GetRegistry();
+                std::lock_guard<std::mutex> lc{ registry.mtx };
+                finished = registry.finished.size();
+            }
+
+            out << "stage count p50 p90 p99 p99.9 max\n";
+            for (int i = 0; i < static_cast<int>(ETraceStage::COUNT); ++i)
+            {
+                const std::unique_ptr<CLatencyHistogram> histogram = Collect(static_cast<ETraceStage>(i));
+                out << names[i] << ' ' << histogram->Count() << ' ' << histogram->Percentile(50) << ' '
+                    << histogram->Percentile(90) << ' ' << histogram->Percentile(99) << ' '
+                    << histogram->Percentile(99.9) << ' ' << histogram->Max() << '\n';
+            }
+            ReuseFinished(finished);
+        }
+
+    private:
+        struct SRegistry
+        {
+            std::mutex mtx;
+            std::vector<std::unique_ptr<SThreadHistograms>> threads;
+            std::vector<SThreadHistograms*> finished; // histograms of exited threads, kept till the next dump
+            std::vector<SThreadHistograms*> spare;    // cleared histograms which new threads take before allocating
+        };
+
+        // Owner of the histograms of one thread, it hands them back when the thread exits
+        struct SHistogramsOwner
+        {
+            SThreadHistograms* local = Acquire();
+
+            ~SHistogramsOwner()
+            {
+                Release(local);
+            }
+        };
+
+        static SRegistry& GetRegistry()
+        {
+            static SRegistry registry;
+            return registry;
+        }
+
+        static SThreadHistograms* Acquire()
+        {
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            if (!registry.spare.empty())
+            {
+                SThreadHistograms* local = registry.spare.back();
+                registry.spare.pop_back();
+                return local;
+            }
+
+            registry.threads.emplace_back(new SThreadHistograms());
+            return registry.threads.back().get();
+        }
+
+        static void Release(SThreadHistograms* local)
+        {
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            registry.finished.push_back(local);
+        }
+
+        // Results of the first count exited threads have been dumped, their histograms are cleared and become spare
+        static void ReuseFinished(size_t count)
+        {
+            SRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lc{ registry.mtx };
+            count = std::min(count, registry.finished.size());
+            for (size_t i = 0; i < count; ++i)
+            {
+                for (auto& histogram : registry.finished[i]->stages)
+                    histogram.Reset();
+                registry.spare.push_back(registry.finished[i]);
+            }
+            registry.finished.erase(registry.finished.begin(), registry.finished.begin() + count);
+        }
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __LatencyTrace_H__
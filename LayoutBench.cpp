@@ -0,0 +1,136 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+// Measures the member layout of CPQueue and CMultiQueueProcessor on the real delivery path: the producer thread
+// enqueues to one queue and the processing thread consumes it, each pinned to its own cpu. The same source is built
+// twice, LayoutBench with the members grouped by the writing side and LayoutBenchPacked with MQP_PACKED_LAYOUT,
+// which keeps the members packed as before the grouping. On Linux the cache misses of all threads are read
+// with perf_event_open, run the binaries under "perf c2c record" to see HITM counts of both layouts.
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include "MultiQueueProcessor.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace MultyQueueProcessor;
+
+namespace
+{
+    class CCounter final
+    {
+    public:
+        void Consume(const uint64_t& value)
+        {
+            sum += value;
+        }
+
+        uint64_t sum = 0;
+    };
+
+    /**
+        \brief Counter of hardware cache misses of the process. The threads created after Start are counted too,
+         their counts are added when they exit.
+    */
+    class CCacheMisses
+    {
+    public:
+        ~CCacheMisses()
+        {
+#ifdef __linux__
+            if (fd >= 0)
+                close(fd);
+#endif
+        }
+
+        bool Start()
+        {
+#ifdef __linux__
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            return fd >= 0;
+#else
+            return false;
+#endif
+        }
+
+        /// \return number of misses or -1 if the counter is not available
+        int64_t Read() const
+        {
+#ifdef __linux__
+            uint64_t count = 0;
+            if (fd >= 0 && read(fd, &count, sizeof(count)) == static_cast<ssize_t>(sizeof(count)))
+                return static_cast<int64_t>(count);
+#endif
+            return -1;
+        }
+
+    private:
+        int fd = -1;
+    };
+}
+
+int main(int argc, char* argv[])
+{
+    const uint64_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000000;
+    const unsigned cpus = std::thread::hardware_concurrency();
+
+    CCacheMisses misses;
+    const bool counted = misses.Start();
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t sum = 0;
+    {
+        CCounter consumer;
+        CMultiQueueProcessor<int, uint64_t, CCounter> processor;
+        if (cpus > 1)
+        {
+            processor.SetProcessorAffinity({ 1 });
+#ifdef __linux__
+            CAffinity::PinThread(pthread_self(), { 0 });
+#endif
+        }
+
+        SQueueOptions<uint64_t> options;
+        options.capacity = 1024;
+        options.full_mode = EFullMode::WAIT;
+        processor.CreateQueue(1, options);
+        processor.Subscribe(1, &consumer).wait();
+
+        for (uint64_t i = 0; i < iterations; ++i)
+            processor.Enqueue(1, i);
+        processor.Flush(std::chrono::seconds(60));
+        sum = consumer.sum;
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+#ifdef MQP_PACKED_LAYOUT
+    std::cout << "packed layout" << std::endl;
+#else
+    std::cout << "grouped layout" << std::endl;
+#endif
+    if (cpus < 2)
+        std::cout << "one cpu only, producer and consumer share it" << std::endl;
+    if (sum != iterations * (iterations - 1) / 2)
+        std::cout << "not all elements consumed" << std::endl;
+    std::cout << "time:         " << std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(iterations) << " ns per element" << std::endl;
+    if (counted)
+        std::cout << "cache misses: " << static_cast<double>(misses.Read()) / static_cast<double>(iterations) << " per element" << std::endl;
+    else
+        std::cout << "cache misses: n/a" << std::endl;
+    return 0;
+}
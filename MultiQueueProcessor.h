@@ -1,228 +1,1576 @@
-// Copyright 2020 Mykhailo Velygodskyi.
-// All Rights Reserved.
-
-#pragma once
-#ifndef __CMultiQueueProcessor_H__
-#define __CMultiQueueProcessor_H__
-
-#include <unordered_map>
-#include <set>
-#include <thread>
-#include <atomic>
-#include "CPQueue.h"
-
-namespace MultyQueueProcessor
-{
-    /**
-        \brief The CMultiQueueProcessor is a template class which allows to create and process multiple queues.
-               Each queue should have unique id. All queues could be filled in a separate threads from any numbers of producers, 
-               but each queue is able to work with only one consumer. All the queues are processed in one separate internal thread.
-    */
-    template<typename KeyType, typename ValueType>
-    class CMultiQueueProcessor : public CPQueue<ValueType>::ICPQNotifier
-    {
-        typedef CPQueue<ValueType> QType;
-        typedef std::unique_ptr<CPQueue<ValueType>> QPtr;
-        typedef CPQueue<ValueType>* RawQPtr;
-    public:
-        CMultiQueueProcessor() 
-        {
-            StartProcessing();
-        }
-
-        ~CMultiQueueProcessor()
-        {
-            if (running)
-            {
-                StopProcessing();
-            }
-            th.join();
-        }
-
-        /**
-            It starts internal thread to process the queues.
-        */
-        void StartProcessing() 
-        {
-            if (!running)
-            {
-                running = true;
-                th = std::thread(std::bind(&CMultiQueueProcessor::Process, this));
-            }
-        }
-
-        /**
-            It stops internal thread to process the queues.
-        */
-        void StopProcessing()
-        {
-            running = false;
-            cv.notify_all();
-        }
-
-        /**
-            It adds consumer to processing certain queue.
-            \param [in] id - unique id of the certain queue.
-            \param [in] consumer - certain consumer, derived from IConsumer interface.
-        */
-        void Subscribe(KeyType id, IConsumer<ValueType> * consumer)
-        {
-            const RawQPtr q = GetQueue(id);
-            if (q)
-            {
-                q->SetConsumer(consumer);
-            }
-
-            std::lock_guard<std::mutex> key_lc{ keys_mtx };
-            keys.insert(id);
-        }
-
-        /**
-            It removes consumer from processing certain queue.
-            \param [in] id - unique id of the certain queue.
-        */
-        void Unsubscribe(KeyType id)
-        {
-            const RawQPtr q = GetQueue(id);
-            if (q)
-            {
-                q->SetConsumer(nullptr);
-            }
-
-            std::lock_guard<std::mutex> key_lc{ keys_mtx };
-            keys.erase(id);
-        }
-
-        /**
-            It creates certain queue with desired behaviour.
-            \param [in] id - unique id for the queue to create.
-            \param [in] fm - value from EFullMode enum. It defines how the queue should work when it is full.
-            \param [in] skip_no_cons - boolean flag which says if the queue needs to skip elements in case of no consumer.
-            \return  - true if the queue has been created or false in other way.
-        */
-        bool CreateQueue(KeyType id, EFullMode fm = EFullMode::SKIP_LAST, bool skip_no_cons = true )
-        {
-            bool result = false;
-            std::lock_guard<std::mutex> lc{ queues_mtx };
-            if (queues.find(id) == queues.end()) 
-            {
-                result = queues.emplace(id, std::make_unique<QType>(MAX_CAPACITY, fm, skip_no_cons, this)).second;
-            }
-
-            return result;
-        }
-
-        /**
-            It deletes certain queue.
-            \param [in] id - unique id of the certain queue.
-        */
-        void DeleteQueue(KeyType id) 
-        {
-            Unsubscribe(id);
-            std::lock_guard<std::mutex> lc{ queues_mtx };
-            queues.erase(id);        
-        }
-
-        /**
-            It puts new element to certain queue.
-            \param [in] id - unique id of the certain queue.
-            \param [in] value - element which should be put in queue.
-        */
-        void Enqueue(KeyType id, ValueType value)
-        {
-            const RawQPtr q = GetQueue(id);
-            if (q)
-            {
-                q->Push(value);
-            }
-        }
-
-    protected:
-        //implementation ICPQNotifier interface
-        virtual void Notify() override 
-        {
-            data_ready_mtx.lock();
-            data_ready = true;
-            data_ready_mtx.unlock();
-
-            cv.notify_all();
-        }
-
-        inline const RawQPtr GetQueue(KeyType id)
-        {
-            std::lock_guard<std::mutex> lc{ queues_mtx };
-            auto it = queues.find(id);
-            if (it != queues.end())
-                return it->second.get();
-            else
-                return nullptr;
-        }
-    
-        void Process()
-        {
-            std::mutex mtx;
-            std::unique_lock<std::mutex> lc{mtx};
-            while (running)
-            {
-                // Sleep while no consumers
-                cv.wait(lc, [this]() {
-                    std::lock_guard<std::mutex> key_loc{ keys_mtx };
-                    return !keys.empty() || !running;
-                });
-
-                std::unique_lock<std::mutex> key_loc{ keys_mtx };
-
-                for (KeyType key : keys) 
-                {
-                    data_ready_mtx.lock();
-                    data_ready = false;
-                    data_ready_mtx.unlock();
-
-                    RawQPtr q = GetQueue(key);
-                    assert(q);
-                    q->Consume();
-
-                    if (!data_ready) 
-                    {
-                        data_ready_mtx.lock();
-                    
-                        bool all_queues_empty = true;
-                        for (KeyType key : keys) 
-                        {
-                            RawQPtr q = GetQueue(key);
-                            assert(q);
-                            if (q->size() > 0)
-                            {
-                                all_queues_empty = false;
-                                break;
-                            }
-                        }
-
-                        data_ready_mtx.unlock();
-                    
-                        if (all_queues_empty)
-                        {
-                            cv.wait(lc, [this]() { return data_ready || !running; });
-                        }
-                    }
-                }
-            }
-        }
-
-    protected:
-        std::set<KeyType> keys;
-        std::unordered_map<KeyType, QPtr> queues;
-
-        bool running = false;
-
-        std::mutex data_ready_mtx;
-        bool data_ready = false;
-
-        std::condition_variable cv;
-        std::mutex keys_mtx;
-        std::mutex queues_mtx;
-        std::thread th;
-    };
-} // end namespace MultyQueueProcessor
-
-#endif // __CMultiQueueProcessor_H__
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __CMultiQueueProcessor_H__
+#define __CMultiQueueProcessor_H__
+
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <initializer_list>
+#include <cassert>
+#include "CPQueue.h"
+#include "ConsumerFunction.h"
+#include "KeyRegistry.h"
+#include "TimerWheel.h"
+
+namespace MultyQueueProcessor
+{
+    /**
+        \brief Settings of the processing threads, see CMultiQueueProcessor::SetSchedulingOptions.
+         The defaults consume one element per queue visit as the original processor did.
+    */
+    struct SSchedulingOptions
+    {
+        size_t max_batch = 0;                                    /// Max number of elements consumed from one queue per visit, 0 means no limit with quantum and 1 without it
+        std::chrono::nanoseconds quantum{ 0 };                   /// Max time spent on one queue per visit, zero means no limit
+        bool adaptive = false;                                   /// Scale batch and quantum by backlog depth of the visited queue
+    };
+
+    /**
+        \brief Settings of slow consumer detection, see CMultiQueueProcessor::SetWatchdog.
+    */
+    template<typename KeyType>
+    struct SWatchdogOptions
+    {
+        std::chrono::nanoseconds threshold{ 0 };                 /// Consumer call longer than this is slow, zero disables the watchdog
+        uint64_t isolate_after = 0;                              /// Number of slow calls after which the queue moves to the isolation thread, zero disables it
+        std::function<void(KeyType, std::chrono::nanoseconds)> on_slow; /// Called by the processing thread after each slow call
+    };
+
+    /**
+        \brief The CMultiQueueProcessor is a template class which allows to create and process multiple queues.
+               Each queue should have unique id. All queues could be filled in a separate threads from any numbers of producers, 
+               but each queue is able to work with only one consumer. All the queues are processed by the pool of internal threads,
+               one queue is never consumed by several threads at once. Partitioned queue consists of several ordered lanes
+               which are consumed in parallel, see SQueueOptions::partitions.
+               ConsumerType could be a final class or a class with not virtual Consume(const ValueType&),
+               so the processing threads call it without virtual dispatch and the call could be inlined.
+               KeyPolicy defines how the queues are found by key, SHashKeys works with any hashable key,
+               SDenseKeys<N> keeps integral keys from 0 to N - 1 in the flat array with lookups without lock.
+               FullPolicy is the full policy of all queues, see CPQueue. With a fixed policy the full mode and
+               skip_if_no_consumer of the queue settings are ignored.
+    */
+    template<typename KeyType, typename ValueType, typename ConsumerType = IConsumer<ValueType>, typename KeyPolicy = SHashKeys,
+        typename FullPolicy = CRuntimeFull>
+    class CMultiQueueProcessor : public CPQueue<ValueType, ConsumerType, FullPolicy>::ICPQNotifier, public CCacheLineAligned
+    {
+        typedef CPQueue<ValueType, ConsumerType, FullPolicy> QType;
+        typedef std::unique_ptr<QType> QPtr;
+        typedef QType* RawQPtr;
+
+        /**
+            \brief Queue of certain key. Each lane keeps order of its elements, simple queue has one lane.
+        */
+        struct SQueueEntry
+        {
+            std::vector<QPtr> lanes;
+            std::function<size_t(const ValueType&)> partition;
+            mutable std::atomic<bool> isolated{ false };
+            bool paused = false; // written under keys_mtx, paused queue is left out of the snapshot
+
+            // Producer threads stage up to staging_size elements in their own buffers, see Stage
+            size_t staging_size = 0;
+            std::chrono::steady_clock::duration staging_delay;
+            uint64_t staging_id = 0; // unique for each queue, key of the thread local buffers
+
+            // Consumer made from callable, the replaced one is freed when no pass could call it
+            mutable std::mutex subscribe_mtx;
+            mutable std::unique_ptr<IConsumer<ValueType>> function;
+
+            RawQPtr Lane(const ValueType& value) const
+            {
+                return lanes.size() == 1 ? lanes.front().get() : lanes[partition(value) % lanes.size()].get();
+            }
+        };
+        typedef std::shared_ptr<SQueueEntry> EntryPtr;
+        typedef typename KeyPolicy::template Registry<KeyType, SQueueEntry> RegistryType;
+
+        /// Subscribed queue in the snapshot which is passed by the processing threads
+        struct SActiveQueue
+        {
+            KeyType key;
+            EntryPtr entry;
+        };
+        typedef std::vector<SActiveQueue> ActiveList;
+        typedef std::unique_ptr<IConsumer<ValueType>> FunctionPtr;
+
+        static const uint64_t IDLE_EPOCH = UINT64_MAX;
+
+        /// Epoch of the snapshot used by one processing thread, IDLE_EPOCH between passes
+        struct SEpochSlot
+        {
+            std::atomic<uint64_t> epoch{ IDLE_EPOCH };
+            char padding[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+        };
+
+        /// Snapshot and consumer replaced by the change of subscriptions, they are freed with the completion of the change
+        struct SRetired
+        {
+            uint64_t epoch;
+            std::unique_ptr<const ActiveList> list;
+            FunctionPtr function;
+            std::promise<void> done;
+        };
+        typedef std::chrono::steady_clock::time_point TimePoint;
+
+        /// Elements staged by one producer thread for one queue, the buffer is shared with the processing threads
+        /// which flush it when the oldest element is staged for staging_delay
+        struct SStaging
+        {
+            std::mutex mtx;
+            std::vector<ValueType> values;
+            TimePoint first_at;                  // time when the oldest staged element has been staged
+            const SQueueEntry* entry = nullptr;  // written under mtx, nullptr after the queue is deleted
+        };
+        typedef std::shared_ptr<SStaging> StagingPtr;
+
+        /// Moves the watermark of EnqueueMulti to its sequence number when all previous numbers have been passed
+        struct SSequencePublisher
+        {
+            std::atomic<uint64_t>& watermark;
+            uint64_t seq;
+
+            ~SSequencePublisher()
+            {
+                while (watermark.load(std::memory_order_acquire) != seq - 1)
+                    std::this_thread::yield();
+                watermark.store(seq, std::memory_order_release);
+            }
+        };
+
+    public:
+        /**
+            Constructor of the processor
+            \param [in] workers - number of internal threads which process the queues.
+        */
+        explicit CMultiQueueProcessor(size_t workers = 1) : worker_count(workers > 0 ? workers : 1),
+            active_owner(new ActiveList()),
+            epoch_slots(new SEpochSlot[worker_count + 1])
+        {
+            active.store(active_owner.get());
+            StartProcessing();
+        }
+
+        ~CMultiQueueProcessor()
+        {
+            if (running)
+            {
+                if (shutdown_timeout > std::chrono::nanoseconds::zero())
+                    Flush(shutdown_timeout);
+                StopProcessing();
+            }
+            JoinWorkers();
+
+            // Pending changes of subscriptions are complete when the threads are stopped
+            Reclaim();
+
+            // Buffers of producer threads could outlive the processor
+            std::lock_guard<std::mutex> lc{ staging_mtx };
+            for (const StagingPtr& staging : stagings)
+                CloseStaging(*staging);
+        }
+
+        /**
+            It starts internal threads to process the queues.
+        */
+        void StartProcessing() 
+        {
+            if (!running)
+            {
+                JoinWorkers();
+
+                running = true;
+                for (size_t i = 0; i < worker_count; ++i)
+                {
+                    workers.emplace_back(std::bind(&CMultiQueueProcessor::Process, this, i, false));
+                }
+
+                if (isolation_active)
+                {
+                    std::lock_guard<std::mutex> lc{ isolation_mtx };
+                    isolation_thread = std::thread(std::bind(&CMultiQueueProcessor::Process, this, worker_count, true));
+                }
+
+                std::lock_guard<std::mutex> lc{ queues_mtx };
+                if (!processor_cpus.empty())
+                {
+                    PinWorkers(processor_cpus);
+                }
+            }
+        }
+
+        /**
+            It stops internal threads to process the queues.
+        */
+        void StopProcessing()
+        {
+            {
+                std::lock_guard<std::mutex> lc{ data_ready_mtx };
+                running = false;
+            }
+            cv.notify_all();
+            isolation_cv.notify_all();
+        }
+
+        /**
+            It waits till the queues are empty or the timeout has expired and stops internal threads.
+            Producers should stop before the call, elements put after it could be left in queues.
+            \param [in] timeout - max time to wait for the pending elements.
+            \return true if all pending elements have been processed or false if the timeout has expired.
+        */
+        template<typename Rep, typename Period>
+        bool Shutdown(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            const bool flushed = running ? Flush(timeout) : IsQuiescent();
+            StopProcessing();
+            JoinWorkers();
+            return flushed;
+        }
+
+        /**
+            It sets the time which the destructor waits for pending elements before it stops internal threads.
+            By default the destructor doesn't wait and the elements left in queues are lost.
+            \param [in] timeout - max time to wait for the pending elements, zero disables waiting.
+        */
+        template<typename Rep, typename Period>
+        void SetShutdownTimeout(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            shutdown_timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout);
+        }
+
+        /**
+            It pins internal threads to the set of cpus. It is applied immediately and on every StartProcessing.
+            \param [in] cpus - list of cpus, empty list removes pinning.
+            \return true if the threads have been pinned or false in other way.
+        */
+        bool SetProcessorAffinity(const std::vector<int>& cpus)
+        {
+            std::lock_guard<std::mutex> lc{ queues_mtx };
+            processor_cpus = cpus;
+            processor_node = cpus.empty() ? -1 : CAffinity::CpuNode(cpus.front());
+            return running ? PinWorkers(cpus) : true;
+        }
+
+        /**
+            It pins internal threads to cpus of NUMA node. Queues created after this call
+            allocate their storage on this node unless SQueueOptions::numa_node says otherwise.
+            \param [in] node - index of NUMA node.
+            \return true if the threads have been pinned or false in other way.
+        */
+        bool SetProcessorNode(int node)
+        {
+            const std::vector<int> cpus = CAffinity::NodeCpus(node);
+            if (cpus.empty())
+                return false;
+
+            const bool result = SetProcessorAffinity(cpus);
+            std::lock_guard<std::mutex> lc{ queues_mtx };
+            processor_node = node;
+            return result;
+        }
+
+        /**
+            It adds consumer to processing certain queue. The change doesn't wait for the processing threads,
+            they pick it up at their next pass.
+            \param [in] id - unique id of the certain queue.
+            \param [in] consumer - certain consumer, derived from IConsumer interface.
+            \return future which is ready when the previous consumer of the queue is not called any more.
+        */
+        std::future<void> Subscribe(KeyType id, ConsumerType * consumer)
+        {
+            FunctionPtr replaced;
+            const SQueueEntry* entry = GetEntry(id);
+            if (entry)
+            {
+                std::lock_guard<std::mutex> lc{ entry->subscribe_mtx };
+                SetConsumer(*entry, consumer);
+                replaced = std::move(entry->function);
+            }
+
+            return Activate(id, std::move(replaced));
+        }
+
+        /**
+            It adds consumer made from the callable to processing certain queue. The processor owns the consumer,
+            it is allocated once per call and freed when no processing thread could call it any more.
+            The queue calls it through IConsumer, a final ConsumerType of the processor gets the call inlined.
+            \param [in] id - unique id of the certain queue.
+            \param [in] callable - lambda or function object which could be called with const ValueType&.
+            \return future which is ready when the previous consumer of the queue is not called any more.
+        */
+        template<typename F, typename C = ConsumerType,
+            typename = typename std::enable_if<std::is_same<C, IConsumer<ValueType>>::value && !std::is_convertible<F, C*>::value>::type>
+        std::future<void> Subscribe(KeyType id, F&& callable)
+        {
+            FunctionPtr replaced;
+            const SQueueEntry* entry = GetEntry(id);
+            if (entry)
+            {
+                FunctionPtr function(new CCallableConsumer<ValueType, typename std::decay<F>::type>(std::forward<F>(callable)));
+                std::lock_guard<std::mutex> lc{ entry->subscribe_mtx };
+                SetConsumer(*entry, function.get());
+                replaced = std::move(entry->function);
+                entry->function = std::move(function);
+            }
+
+            return Activate(id, std::move(replaced));
+        }
+
+        /**
+            It removes consumer from processing certain queue. The change doesn't wait for the processing threads,
+            a consume which is in progress could still call the consumer.
+            \param [in] id - unique id of the certain queue.
+            \return future which is ready when the consumer is not called any more, it could be destroyed after that.
+        */
+        std::future<void> Unsubscribe(KeyType id)
+        {
+            FunctionPtr replaced;
+            const SQueueEntry* entry = GetEntry(id);
+            if (entry)
+            {
+                std::lock_guard<std::mutex> lc{ entry->subscribe_mtx };
+                SetConsumer(*entry, nullptr);
+                replaced = std::move(entry->function);
+            }
+
+            std::lock_guard<std::mutex> key_lc{ keys_mtx };
+            registry.Deactivate(id);
+            return Publish(std::move(replaced));
+        }
+
+        /**
+            It pauses delivery of certain queue. The queue keeps accepting elements and its consumer,
+            internal threads don't visit it till ResumeQueue. The change doesn't wait for the processing threads,
+            a consume which is in progress could still finish.
+            \param [in] id - unique id of the certain queue.
+            \return future which is ready when the consumer of the queue is not called any more.
+        */
+        std::future<void> PauseQueue(KeyType id)
+        {
+            std::lock_guard<std::mutex> key_lc{ keys_mtx };
+            SQueueEntry* entry = registry.Find(id);
+            if (entry)
+                entry->paused = true;
+            return Publish();
+        }
+
+        /**
+            It resumes delivery of certain queue paused by PauseQueue, elements put meanwhile are delivered in order.
+            \param [in] id - unique id of the certain queue.
+        */
+        void ResumeQueue(KeyType id)
+        {
+            {
+                std::lock_guard<std::mutex> key_lc{ keys_mtx };
+                SQueueEntry* entry = registry.Find(id);
+                if (!entry || !entry->paused)
+                    return;
+
+                entry->paused = false;
+                Publish();
+            }
+            Notify();
+        }
+
+        /**
+            It sets how much work internal threads do on one queue before they move to the next one.
+            Each visit consumes up to max_batch elements and stops when the quantum is over, so a deep queue
+            is drained in batches and the other queues are still visited on every pass. Quantum without max_batch
+            limits the visit by time only. In adaptive mode the batch is half of the backlog limited by max_batch,
+            the quantum is scaled in the same proportion if max_batch is set, so shallow queues keep one element per visit.
+            \param [in] options - settings of the processing threads, see SSchedulingOptions.
+        */
+        void SetSchedulingOptions(const SSchedulingOptions& options)
+        {
+            std::lock_guard<std::mutex> lc{ queues_mtx };
+            scheduling = options;
+        }
+
+        /**
+            It enables measuring of each consumer call. Slow calls are reported to options.on_slow, and the queue
+            whose consumer has been slow options.isolate_after times is moved to the dedicated isolation thread,
+            so it doesn't delay the other queues. The isolation thread is started with the first isolated queue.
+            \param [in] options - settings of the watchdog, see SWatchdogOptions.
+        */
+        void SetWatchdog(const SWatchdogOptions<KeyType>& options)
+        {
+            std::lock_guard<std::mutex> lc{ queues_mtx };
+            watchdog = options.threshold.count() > 0 ? std::make_shared<SWatchdogOptions<KeyType>>(options) : nullptr;
+            registry.ForEach([&options](KeyType, const SQueueEntry& entry) {
+                for (const QPtr& q : entry.lanes)
+                {
+                    q->SetSlowConsumeThreshold(options.threshold);
+                }
+            });
+        }
+
+        /**
+            \param [in] id - unique id of the certain queue.
+            \return true if the queue is consumed by the isolation thread, see SetWatchdog.
+        */
+        bool IsIsolated(KeyType id)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            return entry ? entry->isolated.load() : false;
+        }
+
+        /**
+            It creates certain queue with desired behaviour.
+            \param [in] id - unique id for the queue to create.
+            \param [in] fm - value from EFullMode enum. It defines how the queue should work when it is full.
+            \param [in] skip_no_cons - boolean flag which says if the queue needs to skip elements in case of no consumer.
+            \return  - true if the queue has been created or false in other way.
+        */
+        bool CreateQueue(KeyType id, EFullMode fm = EFullMode::SKIP_LAST, bool skip_no_cons = true )
+        {
+            SQueueOptions<ValueType> options;
+            options.full_mode = fm;
+            options.skip_if_no_consumer = skip_no_cons;
+            return CreateQueue(id, options);
+        }
+
+        /**
+            It creates certain queue with desired behaviour.
+            If options.numa_node is -1 the storage is placed on the node of internal threads, see SetProcessorNode.
+            If options.partitions > 1 the queue consists of that number of lanes, options.partition_function maps
+            an element to its lane. Elements of one lane are consumed in order and never concurrently,
+            different lanes are consumed by different internal threads in parallel with the same consumer.
+            Each lane has options.capacity, its durable and spill log paths get the lane index as suffix.
+            If options.staging_size > 0 each producer thread stages its elements and puts them in queue in batches,
+            see FlushStaging. Order of elements is kept for each producer thread.
+            \param [in] id - unique id for the queue to create.
+            \param [in] options - settings of the queue, see SQueueOptions.
+            \return  - true if the queue has been created or false in other way.
+        */
+        bool CreateQueue(KeyType id, SQueueOptions<ValueType> options)
+        {
+            const size_t partitions = options.partitions > 0 ? options.partitions : 1;
+            if (partitions > 1 && !options.partition_function)
+                return false;
+
+            // Processing threads flush staged elements, so they could be blocked by WAIT
+            if (options.staging_size > 0 && FullPolicy(options.full_mode, options.skip_if_no_consumer).Mode() == EFullMode::WAIT)
+                return false;
+
+            std::lock_guard<std::mutex> lc{ queues_mtx };
+            if (!registry.IsValidKey(id) || registry.Find(id) != nullptr)
+                return false;
+
+            if (options.numa_node < 0)
+            {
+                options.numa_node = processor_node;
+            }
+
+            EntryPtr entry = std::make_shared<SQueueEntry>();
+            entry->partition = options.partition_function;
+            entry->staging_size = options.staging_size;
+            entry->staging_delay = options.staging_delay;
+            entry->staging_id = NextStagingId();
+            // Each lane owns its log files, so the configured paths get the lane number
+            const std::string persistence_path = options.persistence.path;
+            const std::string spill_path = options.spill.path;
+            for (size_t i = 0; i < partitions; ++i)
+            {
+                if (partitions > 1 && !persistence_path.empty())
+                {
+                    options.persistence.path = persistence_path + "." + std::to_string(i);
+                }
+                if (partitions > 1 && !spill_path.empty())
+                {
+                    options.spill.path = spill_path + "." + std::to_string(i);
+                }
+
+                QPtr q = std::make_unique<QType>(options, this);
+                if (!q->IsReady())
+                    return false;
+                q->SetOutstandingCounter(&outstanding);
+                if (watchdog)
+                    q->SetSlowConsumeThreshold(watchdog->threshold);
+                MQP_EVENT(ETraceEvent::QUEUE_CREATE, q.get(), std::hash<KeyType>()(id));
+                entry->lanes.push_back(std::move(q));
+            }
+
+            // The key could be subscribed before the queue is created
+            std::lock_guard<std::mutex> key_lc{ keys_mtx };
+            if (!registry.Insert(id, std::move(entry)))
+                return false;
+            Publish();
+            return true;
+        }
+
+        /**
+            It deletes certain queue.
+            \param [in] id - unique id of the certain queue.
+        */
+        void DeleteQueue(KeyType id) 
+        {
+            Unsubscribe(id);
+            std::lock_guard<std::mutex> lc{ queues_mtx };
+            EntryPtr entry;
+            {
+                // Processing threads which still pass the old snapshot keep the entry alive till the end of the pass
+                std::lock_guard<std::mutex> key_lc{ keys_mtx };
+                entry = registry.Erase(id);
+                Publish();
+            }
+            if (entry)
+            {
+                if (entry->staging_size > 0)
+                    CloseStagings(*entry);
+
+                // Elements of the deleted queue are not pending any more, though the queue could live till the next epoch
+                for (const QPtr& q : entry->lanes)
+                {
+                    q->SetOutstandingCounter(nullptr);
+                    MQP_EVENT(ETraceEvent::QUEUE_DELETE, q.get(), std::hash<KeyType>()(id));
+                }
+            }
+        }
+
+        /**
+            It puts new element to certain queue.
+            \param [in] id - unique id of the certain queue.
+            \param [in] value - element which should be put in queue.
+        */
+        void Enqueue(KeyType id, ValueType value)
+        {
+            MQP_TRACE(const uint64_t trace_lookup = CLatencyTracer::Now();)
+            const SQueueEntry* entry = GetEntry(id);
+            MQP_TRACE(CLatencyTracer::Record(ETraceStage::LOOKUP, trace_lookup, CLatencyTracer::Now());)
+            if (entry)
+            {
+                if (entry->staging_size > 0)
+                    Stage(id, *entry, std::move(value));
+                else
+                    entry->Lane(value)->Push(value);
+            }
+        }
+
+        /**
+            It puts new element with its own deadline to certain queue.
+            The element is dropped if it is not dequeued till the deadline or till the queue ttl has passed.
+            \param [in] id - unique id of the certain queue.
+            \param [in] value - element which should be put in queue.
+            \param [in] deadline - time after which the element is not delivered.
+        */
+        void Enqueue(KeyType id, ValueType value, std::chrono::steady_clock::time_point deadline)
+        {
+            MQP_TRACE(const uint64_t trace_lookup = CLatencyTracer::Now();)
+            const SQueueEntry* entry = GetEntry(id);
+            MQP_TRACE(CLatencyTracer::Record(ETraceStage::LOOKUP, trace_lookup, CLatencyTracer::Now());)
+            if (entry)
+            {
+                // Staged elements of this thread go first, element with the deadline is not staged
+                if (entry->staging_size > 0)
+                    FlushLocalStaging(*entry);
+                entry->Lane(value)->Push(value, deadline);
+            }
+        }
+
+        /**
+            It puts new element to certain queue at the given time. Till then the element is kept by the timing wheel
+            of the processor, internal threads sleep exactly till the next due element (1 ms resolution).
+            The element is lost if the queue doesn't exist at that time. Internal threads don't wait for room
+            in a full queue in WAIT mode, the element and the later due elements of that queue are put
+            when the room appears. The element is pending from its due time, see IsQuiescent.
+            \param [in] id - unique id of the certain queue.
+            \param [in] value - element which should be put in queue.
+            \param [in] due - time when the element should be put in queue, time in the past means now.
+        */
+        void EnqueueAt(KeyType id, ValueType value, std::chrono::steady_clock::time_point due)
+        {
+            bool earlier = false;
+            {
+                std::lock_guard<std::mutex> lc{ timers_mtx };
+                earlier = due < timers.NextDue();
+                timers.Add(due, std::make_pair(id, std::move(value)));
+                timers_count.store(timers.size() + deferred.size(), std::memory_order_relaxed);
+            }
+
+            // Sleeping threads have to recalculate their wake up time
+            if (earlier)
+                Notify();
+        }
+
+        /**
+            It puts new element to certain queue after the delay, see EnqueueAt.
+            \param [in] id - unique id of the certain queue.
+            \param [in] value - element which should be put in queue.
+            \param [in] delay - time after which the element should be put in queue.
+        */
+        template<typename Rep, typename Period>
+        void EnqueueAfter(KeyType id, ValueType value, const std::chrono::duration<Rep, Period>& delay)
+        {
+            EnqueueAt(id, std::move(value), std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay));
+        }
+
+        /**
+            It puts the range of elements to certain queue under one queue lock with one notification.
+            \param [in] id - unique id of the certain queue.
+            For partitioned queue the elements are split by lanes, each lane gets its part with one lock.
+            \param [in] first, last - range of elements which should be put in queue.
+            \return number of elements which have been put in queue.
+        */
+        template<typename InputIt>
+        size_t EnqueueBatch(KeyType id, InputIt first, InputIt last)
+        {
+            MQP_TRACE(const uint64_t trace_lookup = CLatencyTracer::Now();)
+            const SQueueEntry* entry = GetEntry(id);
+            MQP_TRACE(CLatencyTracer::Record(ETraceStage::LOOKUP, trace_lookup, CLatencyTracer::Now());)
+            if (!entry)
+                return 0;
+
+            if (entry->staging_size > 0)
+                FlushLocalStaging(*entry);
+            return PushBatch(*entry, first, last);
+        }
+
+        /**
+            It puts elements to several queues all or nothing, so consumers never see a part of them.
+            Room for the elements is reserved in each queue in turn, nothing is put if some queue doesn't exist,
+            is full, skips elements because it has no consumer, keeps elements in a log or conflates elements.
+            Then the elements are put with one sequence number and become visible at once when the watermark
+            of the processor passes it. Elements put to the same queues meanwhile are delivered after them.
+            If a push throws, the unused room is released and the sequence number is still passed by the watermark,
+            the elements put before the failure are delivered.
+            \param [in] items - pairs of unique id of the certain queue and element which should be put in it.
+            \return true if all elements have been put or false if none has been put.
+        */
+        bool EnqueueMulti(std::initializer_list<std::pair<KeyType, ValueType>> items)
+        {
+            return EnqueueMulti(items.begin(), items.end());
+        }
+
+        /**
+            It puts elements to several queues all or nothing, see EnqueueMulti above.
+            \param [in] first, last - range of pairs of unique id of the certain queue and element which should be put in it.
+            \return true if all elements have been put or false if none has been put.
+        */
+        template<typename ForwardIt>
+        bool EnqueueMulti(ForwardIt first, ForwardIt last)
+        {
+            // Lane of each element and the room needed in each lane
+            std::vector<std::pair<RawQPtr, const ValueType*>> targets;
+            std::vector<std::pair<RawQPtr, size_t>> rooms;
+            targets.reserve(static_cast<size_t>(std::distance(first, last)));
+            for (; first != last; ++first)
+            {
+                const SQueueEntry* entry = GetEntry(first->first);
+                if (!entry)
+                    return false;
+
+                if (entry->staging_size > 0)
+                    FlushLocalStaging(*entry);
+                const RawQPtr lane = entry->Lane(first->second);
+                targets.emplace_back(lane, &first->second);
+                auto room = std::find_if(rooms.begin(), rooms.end(), [lane](const std::pair<RawQPtr, size_t>& r) { return r.first == lane; });
+                if (room != rooms.end())
+                    ++room->second;
+                else
+                    rooms.emplace_back(lane, 1);
+            }
+
+            // Queues are locked one by one, a failed reservation releases the previous ones
+            for (size_t i = 0; i < rooms.size(); ++i)
+            {
+                if (!rooms[i].first->Reserve(rooms[i].second))
+                {
+                    for (size_t j = 0; j < i; ++j)
+                        rooms[j].first->Unreserve(rooms[j].second);
+                    return false;
+                }
+            }
+
+            {
+                // The watermark is moved in sequence order, so it never passes a batch which is not put completely.
+                // It is moved on exception too, otherwise the next batches would wait for this one forever.
+                SSequencePublisher publisher{ multi_visible, multi_seq.fetch_add(1, std::memory_order_relaxed) + 1 };
+                size_t pushed = 0;
+                try
+                {
+                    for (; pushed < targets.size(); ++pushed)
+                        targets[pushed].first->PushReserved(*targets[pushed].second, publisher.seq, multi_visible);
+                }
+                catch (...)
+                {
+                    for (size_t i = pushed; i < targets.size(); ++i)
+                        targets[i].first->Unreserve(1);
+                    throw;
+                }
+            }
+
+            for (const auto& room : rooms)
+            {
+                room.first->NotifyVisible();
+            }
+            return true;
+        }
+
+        /**
+            It puts elements staged by all producer threads to their queues, see SQueueOptions::staging_size.
+            Elements are staged by Enqueue, each thread has its own buffer for each queue which is put in queue
+            with one lock and one notification when it is full, after staging_delay or by this call.
+        */
+        void FlushStaging()
+        {
+            std::lock_guard<std::mutex> lc{ staging_mtx };
+            for (const StagingPtr& staging : stagings)
+            {
+                std::lock_guard<std::mutex> s_lc{ staging->mtx };
+                FlushStaging(*staging);
+            }
+        }
+
+
+        /**
+            It pops one element from certain queue on the calling thread, bypassing the consumer.
+            The queue should be created with skip_no_cons = false if it has no subscribed consumer.
+            Lanes of partitioned queue are checked in turn, the order is kept within a lane only.
+            \param [in] id - unique id of the certain queue.
+            \param [out] value - popped element.
+            \return true if element has been popped or false if the queue is empty or doesn't exist.
+        */
+        bool TryDequeue(KeyType id, ValueType& value)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            if (entry)
+            {
+                for (const QPtr& q : entry->lanes)
+                {
+                    if (q->TryPop(value))
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+            It pops up to max_count elements from certain queue on the calling thread.
+            \param [in] id - unique id of the certain queue.
+            \param [out] out - output iterator which receives popped elements in queue order.
+            \param [in] max_count - max number of elements to pop.
+            \return number of popped elements.
+        */
+        template<typename OutIt>
+        size_t DequeueBatch(KeyType id, OutIt out, size_t max_count)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            size_t count = 0;
+            if (entry)
+            {
+                for (size_t i = 0; i < entry->lanes.size() && count < max_count; ++i)
+                {
+                    count += entry->lanes[i]->PopBatch(out, max_count - count);
+                }
+            }
+            return count;
+        }
+
+        /**
+            It waits till certain queue gets an element and pops it on the calling thread.
+            The queue should not be deleted while the call is blocked.
+            \param [in] id - unique id of the certain queue.
+            \param [out] value - popped element.
+            \param [in] timeout - max time to wait for an element.
+            \return true if element has been popped or false if the timeout has expired or the queue doesn't exist.
+        */
+        template<typename Rep, typename Period>
+        bool WaitDequeue(KeyType id, ValueType& value, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            if (!entry)
+                return false;
+
+            if (entry->lanes.size() == 1)
+                return entry->lanes.front()->WaitPop(value, timeout);
+
+            // Lanes have separate conditions, so they are polled with short waits on the first one
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            for (;;)
+            {
+                for (const QPtr& q : entry->lanes)
+                {
+                    if (q->TryPop(value))
+                        return true;
+                }
+
+                const auto now = std::chrono::steady_clock::now();
+                if (now >= deadline)
+                    return false;
+
+                const auto slice = std::min<std::chrono::steady_clock::duration>(deadline - now, std::chrono::milliseconds(1));
+                if (entry->lanes.front()->WaitPop(value, slice))
+                    return true;
+            }
+        }
+
+        /**
+            It limits the rate of passing elements of certain queue to its consumer. Throttled queue is skipped
+            by internal threads without blocking them, so other queues keep flowing.
+            For partitioned queue the limit is applied to each lane.
+            \param [in] id - unique id of the certain queue.
+            \param [in] rate - max number of elements per second, 0 removes the limit.
+            \param [in] burst - max number of elements passed at once.
+        */
+        void SetRateLimit(KeyType id, double rate, double burst = 1)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            if (entry)
+            {
+                for (const QPtr& q : entry->lanes)
+                {
+                    q->SetRateLimit(rate, burst);
+                }
+            }
+        }
+
+        /**
+            It changes capacity and full mode of certain queue keeping its elements, see CPQueue::Reconfigure.
+            For partitioned queue the capacity is applied to each lane.
+            \param [in] id - unique id of the certain queue.
+            \param [in] capacity - new max number of elements.
+            \param [in] fm - value from EFullMode enum.
+            \return true if all lanes have been reconfigured, false if the queue doesn't exist, WAIT is requested
+             for the queue with staging or some lane has kept its old settings because it has more elements
+             in memory than the capacity or can't spill.
+        */
+        bool ReconfigureQueue(KeyType id, size_t capacity, EFullMode fm)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            if (!entry || (entry->staging_size > 0 && fm == EFullMode::WAIT))
+                return false;
+
+            bool result = true;
+            for (const QPtr& q : entry->lanes)
+            {
+                result = q->Reconfigure(capacity, fm) && result;
+            }
+
+            // Grown queue could load more elements from its log
+            Notify();
+            return result;
+        }
+
+        /**
+            It drops expired elements of certain queue without waiting for its consumer, see CPQueue::Expire.
+            \param [in] id - unique id of the certain queue.
+            \return number of dropped elements.
+        */
+        size_t Expire(KeyType id)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            size_t count = 0;
+            if (entry)
+            {
+                for (const QPtr& q : entry->lanes)
+                {
+                    count += q->Expire();
+                }
+            }
+            return count;
+        }
+
+        /**
+            \param [in] id - unique id of the certain queue.
+            \param [in] reason - value from EDropReason enum.
+            \return number of elements of certain queue which have not been delivered because of the reason.
+        */
+        uint64_t GetDropCount(KeyType id, EDropReason reason)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            uint64_t count = 0;
+            if (entry)
+            {
+                for (const QPtr& q : entry->lanes)
+                {
+                    count += q->GetDropCount(reason);
+                }
+            }
+            return count;
+        }
+
+        /**
+            It checks without locks if there are no pending elements in queues and due elements in the timing wheel.
+            Element is pending from its Enqueue till its consumer returns, it is dropped or the queue is cleared or deleted.
+            Element of EnqueueAt is pending from the moment it is taken from the timing wheel at its due time.
+            \return true if there are no pending elements.
+        */
+        bool IsQuiescent() const
+        {
+            return outstanding.load(std::memory_order_acquire) == 0;
+        }
+
+        /**
+            It waits till there are no pending elements, see IsQuiescent. Elements of queues without consumer
+            which don't skip them stay pending, so the call waits for them till the timeout. Elements of EnqueueAt
+            which are due at the call are waited for, the ones which are not due yet are not.
+            \param [in] timeout - max time to wait.
+            \return true if there are no pending elements or false if the timeout has expired.
+        */
+        template<typename Rep, typename Period>
+        bool Flush(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            // Due elements are taken from the timing wheel now, the processing threads could be asleep till their tick
+            if (timers_count.load(std::memory_order_relaxed) > 0)
+            {
+                FireTimers();
+                Notify();
+            }
+            FlushStaging();
+            return WaitFor(timeout, [this]() { return IsQuiescent(); });
+        }
+
+        /**
+            It waits till certain queue is empty and the consume of its last element is complete.
+            The queue should not be deleted while the call is blocked.
+            \param [in] id - unique id of the certain queue.
+            \param [in] timeout - max time to wait.
+            \return true if the queue is empty or doesn't exist, false if the timeout has expired.
+        */
+        template<typename Rep, typename Period>
+        bool Drain(KeyType id, const std::chrono::duration<Rep, Period>& timeout)
+        {
+            const SQueueEntry* entry = GetEntry(id);
+            if (!entry)
+                return true;
+
+            if (entry->staging_size > 0)
+                FlushStaging();
+            return WaitFor(timeout, [entry]() {
+                return std::all_of(entry->lanes.begin(), entry->lanes.end(), [](const QPtr& q) { return q->size() == 0; });
+            });
+        }
+
+    protected:
+        //implementation ICPQNotifier interface
+        virtual void Notify() override 
+        {
+            data_ready_mtx.lock();
+            data_ready = true;
+            isolated_ready = true;
+            data_ready_mtx.unlock();
+
+            cv.notify_one();
+            if (isolation_active.load(std::memory_order_relaxed))
+                isolation_cv.notify_one();
+        }
+
+        // Wakes up the threads blocked in Flush and Drain, they check their conditions again
+        virtual void Settled() override
+        {
+            settle_epoch.fetch_add(1);
+            if (settle_waiters.load() > 0)
+            {
+                // The lock orders the change before the check of a waiter which is about to block
+                {
+                    std::lock_guard<std::mutex> lc{ settle_mtx };
+                }
+                settle_cv.notify_all();
+            }
+        }
+
+        inline const SQueueEntry* GetEntry(KeyType id)
+        {
+            return registry.Find(id);
+        }
+
+        // Waits till the condition is true or the timeout has expired. The condition is checked without settle_mtx
+        // and again after each Settled, the epoch read before the check makes sure no Settled is missed in between.
+        template<typename Rep, typename Period, typename Condition>
+        bool WaitFor(const std::chrono::duration<Rep, Period>& timeout, Condition done)
+        {
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            settle_waiters.fetch_add(1);
+            bool result = false;
+            for (;;)
+            {
+                const uint64_t seen = settle_epoch.load();
+                if (done())
+                {
+                    result = true;
+                    break;
+                }
+
+                std::unique_lock<std::mutex> lc{ settle_mtx };
+                if (!settle_cv.wait_until(lc, deadline, [this, seen]() { return settle_epoch.load() != seen; }))
+                {
+                    lc.unlock();
+                    result = done();
+                    break;
+                }
+            }
+            settle_waiters.fetch_sub(1);
+            return result;
+        }
+
+        // Puts the range of elements to the queue, partitioned queue gets them split by lanes with one lock for each lane.
+        template<typename InputIt>
+        size_t PushBatch(const SQueueEntry& entry, InputIt first, InputIt last)
+        {
+            if (entry.lanes.size() == 1)
+                return entry.lanes.front()->PushBatch(first, last);
+
+            std::vector<std::vector<ValueType>> parts(entry.lanes.size());
+            for (; first != last; ++first)
+            {
+                parts[entry.partition(*first) % parts.size()].push_back(*first);
+            }
+
+            size_t count = 0;
+            for (size_t i = 0; i < parts.size(); ++i)
+            {
+                if (!parts[i].empty())
+                    count += entry.lanes[i]->PushBatch(parts[i].begin(), parts[i].end());
+            }
+            return count;
+        }
+
+        static uint64_t NextStagingId()
+        {
+            static std::atomic<uint64_t> last_id{ 0 };
+            return ++last_id;
+        }
+
+        // Buffers of the calling thread by staging_id of their queues
+        static std::unordered_map<uint64_t, StagingPtr>& LocalStagings()
+        {
+            static thread_local std::unordered_map<uint64_t, StagingPtr> local;
+            return local;
+        }
+
+        // Puts the element to the buffer of the calling thread, the full buffer is put in queue at once.
+        // Non-empty buffer is counted as one outstanding element, so IsQuiescent sees staged elements.
+        void Stage(KeyType id, const SQueueEntry& entry, ValueType&& value)
+        {
+            SStaging* staging = LocalStaging(id, entry);
+            if (!staging)
+                return;
+
+            std::lock_guard<std::mutex> lc{ staging->mtx };
+            if (!staging->entry)
+                return;
+
+            // The buffer is counted before the check of its size, FlushStaging settles it in any case
+            const bool first = staging->values.empty();
+            staging->values.push_back(std::move(value));
+            if (first)
+                outstanding.fetch_add(1, std::memory_order_acq_rel);
+
+            if (staging->values.size() >= entry.staging_size)
+            {
+                FlushStaging(*staging);
+            }
+            else if (first && entry.staging_delay > std::chrono::steady_clock::duration::zero())
+            {
+                staging->first_at = std::chrono::steady_clock::now();
+                if (LowerStagingWake(staging->first_at + entry.staging_delay))
+                    Notify();
+            }
+        }
+
+        // Returns the buffer of the calling thread for the queue, it is registered on the first use.
+        // Returns nullptr if the queue has been deleted.
+        SStaging* LocalStaging(KeyType id, const SQueueEntry& entry)
+        {
+            auto& local = LocalStagings();
+            auto it = local.find(entry.staging_id);
+            if (it != local.end())
+                return it->second.get();
+
+            // Buffers of deleted queues are freed with the first buffer of the new queue
+            for (auto i = local.begin(); i != local.end();)
+            {
+                bool closed = false;
+                {
+                    std::lock_guard<std::mutex> s_lc{ i->second->mtx };
+                    closed = i->second->entry == nullptr;
+                }
+                i = closed ? local.erase(i) : std::next(i);
+            }
+
+            StagingPtr staging = std::make_shared<SStaging>();
+            staging->values.reserve(entry.staging_size);
+            {
+                // DeleteQueue closes the buffers after the queue is erased from the registry, so the buffer
+                // registered after that check is closed by it
+                std::lock_guard<std::mutex> lc{ staging_mtx };
+                if (registry.Find(id) != &entry)
+                    return nullptr;
+                staging->entry = &entry;
+                stagings.push_back(staging);
+            }
+            return local.emplace(entry.staging_id, std::move(staging)).first->second.get();
+        }
+
+        // Removes pending elements which are counted by the processor itself, the counter never goes below zero
+        void Settle(int64_t count)
+        {
+            const int64_t before = outstanding.fetch_sub(count, std::memory_order_acq_rel);
+            assert(before >= count);
+            if (before == count)
+                Settled();
+        }
+
+        // Puts the staged elements of the calling thread to the queue
+        void FlushLocalStaging(const SQueueEntry& entry)
+        {
+            auto& local = LocalStagings();
+            auto it = local.find(entry.staging_id);
+            if (it != local.end())
+            {
+                std::lock_guard<std::mutex> lc{ it->second->mtx };
+                FlushStaging(*it->second);
+            }
+        }
+
+        // Puts the staged elements to the queue with one lock and one notification. Should be called under mtx of the buffer,
+        // so the elements of one thread are never reordered by the processing threads.
+        void FlushStaging(SStaging& staging)
+        {
+            if (staging.values.empty() || !staging.entry)
+                return;
+
+            PushBatch(*staging.entry, staging.values.begin(), staging.values.end());
+            staging.values.clear();
+            Settle(1);
+        }
+
+        // Drops the staged elements and detaches the buffer from its queue. Should be called under staging_mtx.
+        void CloseStaging(SStaging& staging)
+        {
+            std::lock_guard<std::mutex> lc{ staging.mtx };
+            if (!staging.values.empty())
+            {
+                staging.values.clear();
+                Settle(1);
+            }
+            staging.entry = nullptr;
+        }
+
+        // Closes the buffers of the deleted queue
+        void CloseStagings(const SQueueEntry& entry)
+        {
+            std::lock_guard<std::mutex> lc{ staging_mtx };
+            auto last = std::remove_if(stagings.begin(), stagings.end(), [this, &entry](const StagingPtr& staging) {
+                if (staging->entry != &entry)
+                    return false;
+                CloseStaging(*staging);
+                return true;
+            });
+            stagings.erase(last, stagings.end());
+        }
+
+        // Moves the time when the processing threads look at the buffers to the earlier due time.
+        // \return true if the time has been moved.
+        bool LowerStagingWake(TimePoint due)
+        {
+            const auto ticks = due.time_since_epoch().count();
+            auto current = staging_wake.load(std::memory_order_acquire);
+            while (ticks < current)
+            {
+                if (staging_wake.compare_exchange_weak(current, ticks, std::memory_order_acq_rel))
+                    return true;
+            }
+            return false;
+        }
+
+        // Puts the buffers staged for staging_delay to their queues and returns time of the next due buffer.
+        // Producers move staging_wake to their due time when they stage the first element, and wake up the threads
+        // if it is earlier. The threads scan the buffers only when staging_wake has come.
+        TimePoint FireStaging()
+        {
+            const auto wake = staging_wake.load(std::memory_order_acquire);
+            if (wake == TimePoint::max().time_since_epoch().count())
+                return TimePoint::max();
+
+            TimePoint now = std::chrono::steady_clock::now();
+            if (now < TimePoint(TimePoint::duration(wake)))
+                return TimePoint(TimePoint::duration(wake));
+
+            // Another thread which scans the buffers sleeps till the next due buffer
+            std::unique_lock<std::mutex> lc{ staging_mtx, std::try_to_lock };
+            if (!lc.owns_lock())
+                return TimePoint::max();
+
+            // Elements staged after the reset move the time back and wake up the threads
+            staging_wake.store(TimePoint::max().time_since_epoch().count(), std::memory_order_release);
+            TimePoint next = TimePoint::max();
+            for (const StagingPtr& staging : stagings)
+            {
+                std::lock_guard<std::mutex> s_lc{ staging->mtx };
+                if (staging->values.empty() || !staging->entry || staging->entry->staging_delay == TimePoint::duration::zero())
+                    continue;
+
+                const TimePoint due = staging->first_at + staging->entry->staging_delay;
+                if (due <= now)
+                    FlushStaging(*staging);
+                else
+                    next = std::min(next, due);
+            }
+            lc.unlock();
+
+            if (next != TimePoint::max())
+                LowerStagingWake(next);
+            return next;
+        }
+
+        // Should be called under subscribe_mtx of the entry. The old consumer could be called till the next epoch.
+        void SetConsumer(const SQueueEntry& entry, ConsumerType* consumer)
+        {
+            for (const QPtr& q : entry.lanes)
+            {
+                q->PublishConsumer(consumer);
+            }
+        }
+
+        std::future<void> Activate(KeyType id, FunctionPtr replaced)
+        {
+            std::future<void> result;
+            {
+                std::lock_guard<std::mutex> key_lc{ keys_mtx };
+                registry.Activate(id);
+                result = Publish(std::move(replaced));
+            }
+
+            // The queue could already have elements, for example replayed from its durable log
+            Notify();
+            return result;
+        }
+
+        // Publishes the new snapshot of subscribed queues and starts the new epoch. Should be called under keys_mtx.
+        // The old snapshot and the replaced consumer are freed when each processing thread is idle or passes a newer snapshot.
+        std::future<void> Publish(FunctionPtr replaced = nullptr)
+        {
+            std::unique_ptr<ActiveList> list(new ActiveList());
+            registry.ForEachActive([&list](KeyType key, const EntryPtr& entry) {
+                if (!entry->paused)
+                    list->push_back(SActiveQueue{ key, entry });
+            });
+
+            SRetired retired_item;
+            retired_item.list = std::move(active_owner);
+            retired_item.function = std::move(replaced);
+            active_owner = std::move(list);
+            active.store(active_owner.get());
+            retired_item.epoch = epoch.fetch_add(1) + 1;
+
+            std::future<void> result = retired_item.done.get_future();
+            {
+                std::lock_guard<std::mutex> lc{ retire_mtx };
+                retired.push_back(std::move(retired_item));
+                retired_count.store(retired.size(), std::memory_order_relaxed);
+            }
+            Reclaim();
+            return result;
+        }
+
+        // Frees retired snapshots and consumers which could not be used by the processing threads any more
+        void Reclaim()
+        {
+            std::vector<SRetired> done;
+            {
+                // Slots are read under the lock, so all retired items have been published before
+                std::lock_guard<std::mutex> lc{ retire_mtx };
+                uint64_t oldest = IDLE_EPOCH;
+                for (size_t i = 0; i <= worker_count; ++i)
+                    oldest = std::min(oldest, epoch_slots[i].epoch.load());
+
+                size_t kept = 0;
+                for (size_t i = 0; i < retired.size(); ++i)
+                {
+                    if (retired[i].epoch <= oldest)
+                        done.push_back(std::move(retired[i]));
+                    else
+                        retired[kept++] = std::move(retired[i]);
+                }
+                retired.resize(kept);
+                retired_count.store(retired.size(), std::memory_order_relaxed);
+            }
+
+            // The snapshot and the consumer are freed before the change is reported complete
+            for (SRetired& item : done)
+            {
+                item.list.reset();
+                item.function.reset();
+                item.done.set_value();
+            }
+        }
+
+        bool PinWorkers(const std::vector<int>& cpus)
+        {
+            bool result = true;
+            for (std::thread& worker : workers)
+            {
+                result = CAffinity::PinThread(worker.native_handle(), cpus) && result;
+            }
+            return result;
+        }
+
+        void JoinWorkers()
+        {
+            for (std::thread& worker : workers)
+            {
+                if (worker.joinable())
+                    worker.join();
+            }
+            workers.clear();
+
+            std::lock_guard<std::mutex> lc{ isolation_mtx };
+            if (isolation_thread.joinable())
+                isolation_thread.join();
+        }
+
+        // Moves the queue to the isolation thread, which is started on the first call.
+        void Isolate(const SQueueEntry& entry)
+        {
+            if (entry.isolated.exchange(true))
+                return;
+
+            std::lock_guard<std::mutex> lc{ isolation_mtx };
+            isolation_active = true;
+            if (running && !isolation_thread.joinable())
+                isolation_thread = std::thread(std::bind(&CMultiQueueProcessor::Process, this, worker_count, true));
+        }
+
+        // One batch from each lane of each subscribed queue. Lanes which are consumed by another thread are skipped,
+        // that thread passes them again when its consume is over. Throttled lanes are skipped too,
+        // wake_at gets the earliest time when one of them could be consumed.
+        // The isolation thread passes isolated queues only, the other threads pass the rest.
+        bool ProcessPass(size_t index, TimePoint& wake_at, bool isolation)
+        {
+            SSchedulingOptions options;
+            std::shared_ptr<const SWatchdogOptions<KeyType>> watch;
+            {
+                std::lock_guard<std::mutex> lc{ queues_mtx };
+                options = scheduling;
+                watch = watchdog;
+            }
+
+            bool consumed = false;
+            // The announced epoch keeps the snapshot and consumers which it refers to alive till the end of the pass
+            SEpochSlot& slot = epoch_slots[index];
+            slot.epoch.store(epoch.load());
+            const ActiveList* list = active.load();
+            for (const SActiveQueue& item : *list)
+            {
+                const KeyType& key = item.key;
+                const SQueueEntry& entry = *item.entry;
+                if (entry.isolated.load(std::memory_order_relaxed) != isolation)
+                    continue;
+
+                for (const QPtr& q : entry.lanes)
+                {
+                    std::chrono::nanoseconds quantum = options.quantum;
+                    size_t budget = options.max_batch > 0 ? options.max_batch : (quantum.count() > 0 ? SIZE_MAX : 1);
+                    if (options.adaptive && budget > 1)
+                    {
+                        budget = std::min(budget, std::max<size_t>(1, q->size() / 2));
+                        if (options.max_batch > 0)
+                            quantum = quantum * budget / options.max_batch;
+                    }
+
+                    TimePoint retry_at;
+                    const TimePoint until = quantum.count() > 0 ? std::chrono::steady_clock::now() + quantum : TimePoint::max();
+                    const uint64_t slow_before = watch ? q->GetSlowConsumeCount() : 0;
+                    MQP_EVENT(ETraceEvent::VISIT_BEGIN, q.get(), std::hash<KeyType>()(key));
+                    const EConsumeResult result = q->TryConsume(retry_at, budget, until);
+                    MQP_EVENT(ETraceEvent::VISIT_END, q.get(), std::hash<KeyType>()(key));
+                    if (result == EConsumeResult::CONSUMED)
+                        consumed = true;
+                    else if (result == EConsumeResult::THROTTLED)
+                        wake_at = std::min(wake_at, retry_at);
+
+                    if (watch)
+                    {
+                        const uint64_t slow = q->GetSlowConsumeCount();
+                        if (slow != slow_before)
+                        {
+                            if (watch->on_slow)
+                                watch->on_slow(key, q->GetLastSlowConsumeTime());
+                            if (watch->isolate_after > 0 && slow >= watch->isolate_after && !isolation)
+                                Isolate(entry);
+                        }
+                    }
+                }
+            }
+            slot.epoch.store(IDLE_EPOCH);
+            if (retired_count.load(std::memory_order_relaxed) > 0)
+                Reclaim();
+            return consumed;
+        }
+
+        // Puts due elements of the timing wheel to their queues and returns time of the next due element.
+        // Element whose lane is full in WAIT mode is deferred with the later elements of that lane and retried
+        // after one tick, so the processing thread never blocks on the queue which only it could drain.
+        TimePoint FireTimers()
+        {
+            if (timers_count.load(std::memory_order_relaxed) == 0)
+                return TimePoint::max();
+
+            // Elements are put by one thread at a time, so the elements of one lane keep their due order
+            std::unique_lock<std::mutex> fire_lc{ fire_mtx, std::try_to_lock };
+            if (!fire_lc.owns_lock())
+                return TimePoint::max();
+
+            std::vector<std::pair<KeyType, ValueType>> due;
+            TimePoint next;
+            {
+                std::lock_guard<std::mutex> lc{ timers_mtx };
+                due.swap(deferred);
+                const size_t fired = timers.Advance(std::chrono::steady_clock::now(), [&due](std::pair<KeyType, ValueType>&& item) {
+                    due.push_back(std::move(item));
+                });
+                next = timers.NextDue();
+
+                // Due elements become pending here, before they could be put and consumed
+                if (fired > 0)
+                    outstanding.fetch_add(static_cast<int64_t>(fired), std::memory_order_acq_rel);
+            }
+
+            std::vector<RawQPtr> blocked;
+            std::vector<std::pair<KeyType, ValueType>> retry;
+            int64_t settled = 0;
+            for (auto& item : due)
+            {
+                const SQueueEntry* entry = GetEntry(item.first);
+                if (entry && entry->staging_size == 0)
+                {
+                    const RawQPtr lane = entry->Lane(item.second);
+                    if (std::find(blocked.begin(), blocked.end(), lane) != blocked.end() || !lane->TryPush(item.second))
+                    {
+                        if (std::find(blocked.begin(), blocked.end(), lane) == blocked.end())
+                            blocked.push_back(lane);
+                        retry.push_back(std::move(item));
+                        continue;
+                    }
+                }
+                else if (entry)
+                {
+                    Stage(item.first, *entry, std::move(item.second));
+                }
+                ++settled;
+            }
+
+            {
+                std::lock_guard<std::mutex> lc{ timers_mtx };
+                deferred.swap(retry);
+                timers_count.store(timers.size() + deferred.size(), std::memory_order_relaxed);
+            }
+            if (!deferred.empty())
+                next = std::min(next, std::chrono::steady_clock::now() + std::chrono::milliseconds(1));
+
+            // Fired elements are counted by their queues now, so the processor doesn't look quiescent in between
+            if (settled > 0)
+                Settle(settled);
+            return next;
+        }
+
+        void Process(size_t index, bool isolation)
+        {
+            // The isolation thread has its own flag, otherwise other threads could reset it before it wakes up
+            bool& ready = isolation ? isolated_ready : data_ready;
+            std::condition_variable& ready_cv = isolation ? isolation_cv : cv;
+            while (running)
+            {
+                // The flag is reset before the pass, so any element pushed after the pass has looked at its queue
+                // sets it again and the thread doesn't sleep
+                data_ready_mtx.lock();
+                ready = false;
+                data_ready_mtx.unlock();
+
+                TimePoint wake_at = isolation ? TimePoint::max() : std::min(FireTimers(), FireStaging());
+                if (ProcessPass(index, wake_at, isolation))
+                    continue;
+
+                std::unique_lock<std::mutex> lc{ data_ready_mtx };
+                MQP_EVENT(ETraceEvent::SLEEP_BEGIN);
+                if (wake_at == TimePoint::max())
+                    ready_cv.wait(lc, [this, &ready]() { return ready || !running; });
+                else
+                    ready_cv.wait_until(lc, wake_at, [this, &ready]() { return ready || !running; });
+                MQP_EVENT(ETraceEvent::SLEEP_END);
+            }
+        }
+
+    protected:
+        // The members are grouped by the side which writes them, each group starts a new cache line.
+        // Read-mostly state, written only on start/stop.
+        MQP_CACHE_ALIGNED std::atomic<bool> running{ false };
+        size_t worker_count;
+        std::vector<std::thread> workers;
+
+        // Written by producers on every Notify.
+        MQP_CACHE_ALIGNED std::mutex data_ready_mtx;
+        bool data_ready = false;
+        bool isolated_ready = false;
+        std::condition_variable cv;
+        std::condition_variable isolation_cv;
+        std::atomic<bool> isolation_active{ false };
+
+        // Queue settings, written on CreateQueue/DeleteQueue and by the setters.
+        MQP_CACHE_ALIGNED std::mutex queues_mtx;
+        std::vector<int> processor_cpus;
+        int processor_node = -1;
+        SSchedulingOptions scheduling;
+        std::shared_ptr<const SWatchdogOptions<KeyType>> watchdog;
+
+        // Thread which consumes the queues with slow consumers, see SetWatchdog.
+        MQP_CACHE_ALIGNED std::mutex isolation_mtx;
+        std::thread isolation_thread;
+
+        // Delayed elements, written by EnqueueAt and by the processing threads which fire them.
+        MQP_CACHE_ALIGNED std::mutex timers_mtx;
+        CTimerWheel<std::pair<KeyType, ValueType>> timers;
+        std::vector<std::pair<KeyType, ValueType>> deferred; // due elements waiting for room in their queues, in due order
+        std::atomic<size_t> timers_count{ 0 };               // number of elements in the wheel and deferred
+        std::mutex fire_mtx;                                 // held by the thread which puts due elements
+
+        // Number of pending elements in queues and due elements of the timing wheel, updated by producers and processing threads.
+        MQP_CACHE_ALIGNED std::atomic<int64_t> outstanding{ 0 };
+        std::chrono::nanoseconds shutdown_timeout{ 0 };
+
+        // Threads blocked in Flush and Drain, woken up by Settled.
+        MQP_CACHE_ALIGNED std::mutex settle_mtx;
+        std::condition_variable settle_cv;
+        std::atomic<uint64_t> settle_epoch{ 0 };
+        std::atomic<size_t> settle_waiters{ 0 };
+
+        // Buffers of producer threads, registered on the first Enqueue of the thread to the queue with staging.
+        MQP_CACHE_ALIGNED std::mutex staging_mtx;
+        std::vector<StagingPtr> stagings;
+        std::atomic<TimePoint::rep> staging_wake{ TimePoint::max().time_since_epoch().count() }; // time to look at the buffers
+
+        // Sequence numbers of EnqueueMulti, elements with numbers up to the watermark are visible to consumers.
+        MQP_CACHE_ALIGNED std::atomic<uint64_t> multi_seq{ 0 };
+        std::atomic<uint64_t> multi_visible{ 0 };
+
+        // Queue registry, read by producers on every Enqueue. Its queues and subscribed keys are written under keys_mtx
+        // by CreateQueue/DeleteQueue and Subscribe/Unsubscribe, which publish the new snapshot of subscribed queues.
+        MQP_CACHE_ALIGNED std::mutex keys_mtx;
+        RegistryType registry;
+
+        // Snapshot of subscribed queues, owned under keys_mtx. The processing threads read it without lock at the start
+        // of each pass and announce its epoch in their slots, the last slot belongs to the isolation thread.
+        std::unique_ptr<const ActiveList> active_owner;
+        MQP_CACHE_ALIGNED std::atomic<const ActiveList*> active{ nullptr };
+        std::atomic<uint64_t> epoch{ 0 };
+        std::unique_ptr<SEpochSlot[]> epoch_slots;
+
+        // Changes of subscriptions which are not complete yet, written by Publish and by the processing threads.
+        MQP_CACHE_ALIGNED std::mutex retire_mtx;
+        std::vector<SRetired> retired;
+        std::atomic<size_t> retired_count{ 0 };
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __CMultiQueueProcessor_H__
@@ -0,0 +1,1200 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <condition_variable>
+#include <stdexcept>
+#include <cstring>
+#include <iterator>
+#include "MultiQueueProcessor.h"
+#include "SharedMultiQueueProcessor.h"
+#include "TestCheck.h"
+
+using namespace MultyQueueProcessor;
+
+namespace
+{
+    class CCollector : public IConsumer<int>
+    {
+    public:
+        void Consume(const int& value) override
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            values.push_back(value);
+        }
+
+        size_t Count()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            return values.size();
+        }
+
+        std::vector<int> Values()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            return values;
+        }
+
+    private:
+        std::mutex mtx;
+        std::vector<int> values;
+    };
+
+    // Consumer which takes some time for each element, so elements are still pending when the producer is done
+    class CSlowCollector : public CCollector
+    {
+    public:
+        void Consume(const int& value) override
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            CCollector::Consume(value);
+        }
+    };
+
+    // Flush waits for all queues, Drain for one queue only
+    void TestFlushAndDrain()
+    {
+        CSlowCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.skip_if_no_consumer = false;
+        MQP_CHECK(processor.CreateQueue(1, options));
+        MQP_CHECK(processor.CreateQueue(2, options));
+        processor.Subscribe(1, &consumer).wait();
+
+        for (int i = 0; i < 20; ++i)
+            processor.Enqueue(1, i);
+        processor.Enqueue(2, 0);
+
+        MQP_CHECK(processor.Drain(1, std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Count() == 20);
+        MQP_CHECK(processor.Drain(3, std::chrono::milliseconds(0)));
+        MQP_CHECK(!processor.IsQuiescent());
+        MQP_CHECK(!processor.Flush(std::chrono::milliseconds(20)));
+
+        processor.Subscribe(2, &consumer).wait();
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Count() == 21);
+    }
+
+    // Element which is not due yet doesn't hold Flush, Drain and the destructor till their timeouts
+    void TestFlushSkipsFutureTimers()
+    {
+        CCollector consumer;
+        const auto start = std::chrono::steady_clock::now();
+        {
+            CMultiQueueProcessor<int, int> processor;
+            processor.SetShutdownTimeout(std::chrono::seconds(10));
+            MQP_CHECK(processor.CreateQueue(1));
+            processor.Subscribe(1, &consumer).wait();
+
+            processor.EnqueueAfter(1, 1, std::chrono::hours(1));
+            processor.Enqueue(1, 2);
+            MQP_CHECK(processor.Flush(std::chrono::seconds(10)));
+            MQP_CHECK(processor.Drain(1, std::chrono::seconds(10)));
+            MQP_CHECK(processor.IsQuiescent());
+        }
+        MQP_CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 2 }));
+    }
+
+    // Shutdown and the destructor with shutdown timeout deliver the pending elements before the threads stop
+    void TestDrainOnShutdown()
+    {
+        CSlowCollector consumer;
+        {
+            CMultiQueueProcessor<int, int> processor;
+            MQP_CHECK(processor.CreateQueue(1));
+            processor.Subscribe(1, &consumer).wait();
+            for (int i = 0; i < 20; ++i)
+                processor.Enqueue(1, i);
+            MQP_CHECK(processor.Shutdown(std::chrono::seconds(5)));
+            MQP_CHECK(consumer.Count() == 20);
+        }
+
+        {
+            CMultiQueueProcessor<int, int> processor;
+            processor.SetShutdownTimeout(std::chrono::seconds(5));
+            MQP_CHECK(processor.CreateQueue(1));
+            processor.Subscribe(1, &consumer).wait();
+            for (int i = 0; i < 20; ++i)
+                processor.Enqueue(1, i);
+        }
+        MQP_CHECK(consumer.Count() == 40);
+    }
+
+    // Paused queue keeps its elements and delivers them in order after resume
+    void TestPauseResume()
+    {
+        CCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        MQP_CHECK(processor.CreateQueue(1));
+        processor.Subscribe(1, &consumer).wait();
+
+        processor.PauseQueue(1).wait();
+        for (int i = 0; i < 5; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(!processor.Flush(std::chrono::milliseconds(20)));
+        MQP_CHECK(consumer.Count() == 0);
+
+        processor.ResumeQueue(1);
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 0, 1, 2, 3, 4 }));
+    }
+
+    // Reconfigure keeps the elements, it refuses the capacity below them and WAIT for the staged queue
+    void TestReconfigure()
+    {
+        CCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.capacity = 2;
+        options.skip_if_no_consumer = false;
+        MQP_CHECK(processor.CreateQueue(1, options));
+
+        for (int i = 0; i < 3; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::QUEUE_FULL) == 1);
+
+        MQP_CHECK(!processor.ReconfigureQueue(1, 1, EFullMode::SKIP_LAST));
+        MQP_CHECK(processor.ReconfigureQueue(1, 3, EFullMode::DROP_FIRST));
+        for (int i = 3; i < 5; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::QUEUE_FULL) == 1);
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::EVICTED) == 1);
+
+        processor.Subscribe(1, &consumer).wait();
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 1, 3, 4 }));
+        MQP_CHECK(processor.ReconfigureQueue(1, 3, EFullMode::WAIT));
+
+        SQueueOptions<int> staged;
+        staged.staging_size = 4;
+        MQP_CHECK(processor.CreateQueue(2, staged));
+        MQP_CHECK(!processor.ReconfigureQueue(2, 8, EFullMode::WAIT));
+        MQP_CHECK(processor.ReconfigureQueue(2, 8, EFullMode::DROP_FIRST));
+    }
+
+    // Staged elements are pending, they reach the queue when the stage is full, flushed or its delay is over
+    void TestStaging()
+    {
+        CCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.staging_size = 4;
+        options.staging_delay = std::chrono::steady_clock::duration::zero();
+        MQP_CHECK(processor.CreateQueue(1, options));
+        options.staging_delay = std::chrono::milliseconds(5);
+        MQP_CHECK(processor.CreateQueue(2, options));
+        processor.Subscribe(1, &consumer);
+        processor.Subscribe(2, &consumer).wait();
+
+        for (int i = 0; i < 6; ++i)
+            processor.Enqueue(1, i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        MQP_CHECK(consumer.Count() == 4);
+        MQP_CHECK(!processor.IsQuiescent());
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Count() == 6);
+        MQP_CHECK(processor.IsQuiescent());
+
+        processor.Enqueue(2, 6);
+        for (int i = 0; i < 500 && consumer.Count() < 7; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        MQP_CHECK(consumer.Count() == 7);
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 0, 1, 2, 3, 4, 5, 6 }));
+    }
+
+    // EnqueueMulti puts all elements or none of them
+    void TestEnqueueMulti()
+    {
+        CCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.capacity = 1;
+        options.skip_if_no_consumer = false;
+        MQP_CHECK(processor.CreateQueue(1));
+        MQP_CHECK(processor.CreateQueue(2, options));
+        processor.Subscribe(1, &consumer).wait();
+
+        MQP_CHECK(processor.EnqueueMulti({ { 1, 1 }, { 2, 2 } }));
+        MQP_CHECK(!processor.EnqueueMulti({ { 1, 3 }, { 2, 4 } }));
+        MQP_CHECK(!processor.EnqueueMulti({ { 1, 5 }, { 9, 6 } }));
+        MQP_CHECK(processor.Drain(1, std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 1 }));
+
+        int value = 0;
+        MQP_CHECK(processor.TryDequeue(2, value) && value == 2);
+        MQP_CHECK(!processor.TryDequeue(2, value));
+        MQP_CHECK(processor.IsQuiescent());
+    }
+
+    // Full buffer of one element is flushed by the same Enqueue which has counted it
+    void TestStagingSizeOne()
+    {
+        CCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.staging_size = 1;
+        options.skip_if_no_consumer = false;
+        MQP_CHECK(processor.CreateQueue(1, options));
+
+        for (int i = 0; i < 5; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(!processor.IsQuiescent());
+        MQP_CHECK(!processor.Flush(std::chrono::milliseconds(20)));
+
+        processor.Subscribe(1, &consumer).wait();
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Count() == 5);
+        MQP_CHECK(processor.IsQuiescent());
+    }
+
+    // Callable consumer is owned by the processor and freed once it is replaced
+    void TestSubscribeCallable()
+    {
+        std::shared_ptr<std::atomic<int>> calls = std::make_shared<std::atomic<int>>(0);
+        CMultiQueueProcessor<int, int> processor;
+        MQP_CHECK(processor.CreateQueue(1));
+        processor.Subscribe(1, [calls](const int&) { ++*calls; }).wait();
+        MQP_CHECK(calls.use_count() == 2);
+
+        processor.Enqueue(1, 1);
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(*calls == 1);
+
+        CCollector consumer;
+        processor.Subscribe(1, &consumer).wait();
+        MQP_CHECK(calls.use_count() == 1);
+    }
+
+    // Full policy fixed at compile time ignores the settings of the queue and refuses another mode
+    void TestFixedFullPolicy()
+    {
+        CCollector consumer;
+        CMultiQueueProcessor<int, int, IConsumer<int>, SHashKeys, SDropFirst<false>> processor;
+        SQueueOptions<int> options;
+        options.capacity = 2;
+        options.full_mode = EFullMode::WAIT;
+        MQP_CHECK(processor.CreateQueue(1, options));
+
+        for (int i = 0; i < 4; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::EVICTED) == 2);
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::NO_CONSUMER) == 0);
+        MQP_CHECK(!processor.ReconfigureQueue(1, 4, EFullMode::SKIP_LAST));
+        MQP_CHECK(processor.ReconfigureQueue(1, 4, EFullMode::DROP_FIRST));
+
+        processor.Subscribe(1, &consumer).wait();
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 2, 3 }));
+    }
+
+    // Elements of EnqueueMulti get the ttl of their queue, conflating queues are not used for hidden elements
+    void TestEnqueueMultiTtlAndConflation()
+    {
+        CCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.skip_if_no_consumer = false;
+        options.ttl = std::chrono::milliseconds(1);
+        MQP_CHECK(processor.CreateQueue(1, options));
+        MQP_CHECK(processor.CreateQueue(2));
+        processor.Subscribe(2, &consumer).wait();
+
+        MQP_CHECK(processor.EnqueueMulti({ { 1, 1 }, { 2, 1 } }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        MQP_CHECK(processor.Expire(1) == 1);
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::EXPIRED) == 1);
+
+        SQueueOptions<int> conflating;
+        conflating.conflation_key = [](const int& value) { return static_cast<uint64_t>(value); };
+        MQP_CHECK(processor.CreateQueue(3, conflating));
+        processor.Subscribe(3, &consumer).wait();
+        MQP_CHECK(!processor.EnqueueMulti({ { 2, 2 }, { 3, 2 } }));
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Count() == 1);
+    }
+
+    // Value whose copy throws while the flag is set
+    struct SFragile
+    {
+        static bool& Armed()
+        {
+            static bool armed = false;
+            return armed;
+        }
+
+        SFragile(int v = 0) : value(v) {}
+        SFragile(const SFragile& other) : value(other.value)
+        {
+            if (value < 0 && Armed())
+                throw std::runtime_error("copy failed");
+        }
+        SFragile& operator=(const SFragile& other) = default;
+
+        int value;
+    };
+
+    class CFragileCollector : public IConsumer<SFragile>
+    {
+    public:
+        void Consume(const SFragile&) override
+        {
+            ++count;
+        }
+
+        std::atomic<int> count{ 0 };
+    };
+
+    // The failed batch still passes the watermark, so the next batches are not blocked behind it
+    void TestEnqueueMultiThrowingPush()
+    {
+        CFragileCollector consumer;
+        CMultiQueueProcessor<int, SFragile> processor;
+        SQueueOptions<SFragile> options;
+        options.capacity = 2;
+        MQP_CHECK(processor.CreateQueue(1, options));
+        MQP_CHECK(processor.CreateQueue(2, options));
+        processor.Subscribe(1, &consumer);
+        processor.Subscribe(2, &consumer).wait();
+
+        std::vector<std::pair<int, SFragile>> batch{ { 1, SFragile(1) }, { 2, SFragile(-1) }, { 2, SFragile(2) } };
+        SFragile::Armed() = true;
+        bool thrown = false;
+        try
+        {
+            processor.EnqueueMulti(batch.begin(), batch.end());
+        }
+        catch (const std::runtime_error&)
+        {
+            thrown = true;
+        }
+        SFragile::Armed() = false;
+        MQP_CHECK(thrown);
+
+        // The room of queue 2 has been released, so the full batch fits
+        std::vector<std::pair<int, SFragile>> next{ { 1, SFragile(3) }, { 2, SFragile(4) }, { 2, SFragile(5) } };
+        MQP_CHECK(processor.EnqueueMulti(next.begin(), next.end()));
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.count == 4);
+    }
+
+    // Consumer which remembers when each element has been consumed
+    class CTimedCollector : public CCollector
+    {
+    public:
+        void Consume(const int& value) override
+        {
+            {
+                std::lock_guard<std::mutex> lc{ mtx };
+                times.push_back(std::chrono::steady_clock::now());
+            }
+            CCollector::Consume(value);
+        }
+
+        std::vector<std::chrono::steady_clock::time_point> Times()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            return times;
+        }
+
+    private:
+        std::mutex mtx;
+        std::vector<std::chrono::steady_clock::time_point> times;
+    };
+
+    // Delayed elements are put in due order, not earlier than their due time
+    void TestEnqueueAtOrder()
+    {
+        CTimedCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        MQP_CHECK(processor.CreateQueue(1));
+        processor.Subscribe(1, &consumer).wait();
+
+        const auto start = std::chrono::steady_clock::now();
+        const std::chrono::milliseconds delays[] = { std::chrono::milliseconds(300), std::chrono::milliseconds(200), std::chrono::milliseconds(100) };
+        for (int i = 0; i < 3; ++i)
+            processor.EnqueueAt(1, 3 - i, start + delays[i]);
+        processor.EnqueueAt(1, 0, start - std::chrono::seconds(1));
+
+        for (int i = 0; i < 500 && consumer.Count() < 1; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        MQP_CHECK(consumer.Count() == 1);
+
+        // Flush waits for the elements which are due at the call only, the wheel rounds due time up to its tick
+        std::this_thread::sleep_until(start + delays[0] + std::chrono::milliseconds(5));
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 0, 1, 2, 3 }));
+        const std::vector<std::chrono::steady_clock::time_point> times = consumer.Times();
+        for (size_t i = 1; i < times.size(); ++i)
+            MQP_CHECK(times[i] >= start + delays[3 - i]);
+    }
+
+    // Due element of a full queue in WAIT mode doesn't block the only processing thread, which drains that queue
+    void TestEnqueueAfterWaitQueue()
+    {
+        CCollector first;
+        CCollector second;
+        CMultiQueueProcessor<int, int> processor(1);
+        SQueueOptions<int> options;
+        options.capacity = 1;
+        options.full_mode = EFullMode::WAIT;
+        MQP_CHECK(processor.CreateQueue(1, options));
+        MQP_CHECK(processor.CreateQueue(2));
+        processor.Subscribe(1, &first);
+        processor.Subscribe(2, &second).wait();
+
+        for (int i = 0; i < 3; ++i)
+            processor.EnqueueAfter(1, i, std::chrono::milliseconds(5));
+        processor.EnqueueAfter(2, 10, std::chrono::milliseconds(5));
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        MQP_CHECK(processor.Flush(std::chrono::seconds(2)));
+        MQP_CHECK(first.Values() == std::vector<int>({ 0, 1, 2 }));
+        MQP_CHECK(second.Values() == std::vector<int>({ 10 }));
+    }
+
+    // Consumer which keeps elements of each lane apart and counts the lanes consumed at once
+    class CLaneCollector : public IConsumer<int>
+    {
+    public:
+        explicit CLaneCollector(size_t lanes, std::chrono::milliseconds delay = std::chrono::milliseconds(0)) : values(lanes), delay(delay)
+        {
+        }
+
+        void Consume(const int& value) override
+        {
+            const size_t now_active = ++active;
+            size_t seen = max_active.load();
+            while (now_active > seen && !max_active.compare_exchange_weak(seen, now_active))
+            {
+            }
+            std::this_thread::sleep_for(delay);
+            {
+                std::lock_guard<std::mutex> lc{ mtx };
+                values[value % values.size()].push_back(value);
+            }
+            --active;
+        }
+
+        std::vector<std::vector<int>> Values()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            return values;
+        }
+
+        size_t MaxActive() const
+        {
+            return max_active.load();
+        }
+
+    private:
+        std::mutex mtx;
+        std::vector<std::vector<int>> values;
+        std::chrono::milliseconds delay;
+        std::atomic<size_t> active{ 0 };
+        std::atomic<size_t> max_active{ 0 };
+    };
+
+    // Lanes of a partitioned queue are consumed by several threads at once, each lane in order
+    void TestPartitionedWorkers()
+    {
+        const size_t lanes = 4;
+        CLaneCollector consumer(lanes, std::chrono::milliseconds(2));
+        CMultiQueueProcessor<int, int> processor(lanes);
+        SQueueOptions<int> options;
+        options.partitions = lanes;
+        options.partition_function = [lanes](const int& value) { return static_cast<size_t>(value) % lanes; };
+        MQP_CHECK(processor.CreateQueue(1, options));
+        processor.Subscribe(1, &consumer).wait();
+
+        for (int i = 0; i < 80; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(processor.Flush(std::chrono::seconds(10)));
+
+        const std::vector<std::vector<int>> values = consumer.Values();
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            MQP_CHECK(values[lane].size() == 20);
+            for (size_t i = 0; i < values[lane].size(); ++i)
+                MQP_CHECK(values[lane][i] == static_cast<int>(lane + i * lanes));
+        }
+        MQP_CHECK(consumer.MaxActive() > 1);
+    }
+
+    // Lanes which spill to the configured path get own files and keep own order
+    void TestPartitionedSpill()
+    {
+        const size_t lanes = 2;
+        const int total = 4000;
+        CLaneCollector consumer(lanes);
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.capacity = 2;
+        options.full_mode = EFullMode::SPILL;
+        options.spill.path = CMappedFile::TempPath("mqp_test_spill");
+        options.spill.segment_size = 4096;
+        options.partitions = lanes;
+        options.partition_function = [lanes](const int& value) { return static_cast<size_t>(value) % lanes; };
+        MQP_CHECK(processor.CreateQueue(1, options));
+        processor.Subscribe(1, &consumer).wait();
+
+        for (int i = 0; i < total; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(processor.Flush(std::chrono::seconds(10)));
+
+        const std::vector<std::vector<int>> values = consumer.Values();
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            MQP_CHECK(values[lane].size() == total / lanes);
+            for (size_t i = 0; i < values[lane].size(); ++i)
+                MQP_CHECK(values[lane][i] == static_cast<int>(lane + i * lanes));
+        }
+    }
+
+    // Removes the segment and offset files of the durable log
+    void RemoveLog(const std::string& path)
+    {
+        const size_t slash = path.rfind('/');
+        const std::string dir = path.substr(0, slash);
+        const std::string prefix = path.substr(slash + 1) + ".";
+        for (const std::string& name : CMappedFile::List(dir))
+        {
+            if (name.compare(0, prefix.size(), prefix) == 0)
+                CMappedFile::Remove(dir + "/" + name);
+        }
+    }
+
+    // Elements which have not been consumed before the queue is destroyed are replayed once after reopening
+    void TestPersistenceReplay()
+    {
+        SQueueOptions<int> options;
+        options.skip_if_no_consumer = false;
+        options.persistence.path = CMappedFile::TempPath("mqp_test_durable");
+        options.persistence.segment_size = 4096;
+        std::vector<int> values;
+        for (int i = 0; i < 300; ++i)
+            values.push_back(i);
+
+        CCollector first;
+        {
+            CPQueue<int> queue(options);
+            MQP_CHECK(queue.IsReady());
+            MQP_CHECK(queue.PushBatch(values.begin(), values.end()) == values.size());
+            queue.SetConsumer(&first);
+            for (int i = 0; i < 100; ++i)
+                MQP_CHECK(queue.Consume());
+        }
+
+        CCollector second;
+        {
+            CPQueue<int> queue(options);
+            MQP_CHECK(queue.IsReady());
+            MQP_CHECK(queue.size() == 200);
+            queue.SetConsumer(&second);
+            while (queue.Consume())
+            {
+            }
+        }
+
+        CCollector third;
+        {
+            CPQueue<int> queue(options);
+            MQP_CHECK(queue.IsReady());
+            MQP_CHECK(queue.size() == 0);
+            queue.SetConsumer(&third);
+            MQP_CHECK(!queue.Consume());
+        }
+
+        std::vector<int> consumed = first.Values();
+        const std::vector<int> replayed = second.Values();
+        consumed.insert(consumed.end(), replayed.begin(), replayed.end());
+        MQP_CHECK(consumed == values);
+        MQP_CHECK(third.Count() == 0);
+        RemoveLog(options.persistence.path);
+    }
+
+    // Element which the log can't take is counted as dropped and not as pushed
+    void TestLogError()
+    {
+        SQueueOptions<std::string> options;
+        options.skip_if_no_consumer = false;
+        options.persistence.path = CMappedFile::TempPath("mqp_test_durable");
+        options.persistence.segment_size = 4096;
+        {
+            CPQueue<std::string> queue(options);
+            MQP_CHECK(queue.IsReady());
+
+            const std::vector<std::string> values = { "first", std::string(8192, 'x'), "last" };
+            MQP_CHECK(queue.PushBatch(values.begin(), values.end()) == 2);
+            MQP_CHECK(queue.GetDropCount(EDropReason::LOG_ERROR) == 1);
+            MQP_CHECK(queue.size() == 2);
+        }
+        RemoveLog(options.persistence.path);
+    }
+
+    // Elements beyond the capacity are spilled and delivered in order, the grown queue loads more of them at once
+    void TestSpill()
+    {
+        CCollector consumer;
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.capacity = 4;
+        options.full_mode = EFullMode::SPILL;
+        options.skip_if_no_consumer = false;
+        options.spill.segment_size = 4096;
+        MQP_CHECK(processor.CreateQueue(1, options));
+
+        std::vector<int> values;
+        for (int i = 0; i < 1000; ++i)
+        {
+            values.push_back(i);
+            processor.Enqueue(1, i);
+        }
+        MQP_CHECK(processor.ReconfigureQueue(1, 64, EFullMode::SPILL));
+        MQP_CHECK(!processor.ReconfigureQueue(1, 8, EFullMode::SPILL));
+
+        processor.Subscribe(1, &consumer).wait();
+        MQP_CHECK(processor.Flush(std::chrono::seconds(10)));
+        MQP_CHECK(consumer.Values() == values);
+        for (int reason = 0; reason < static_cast<int>(EDropReason::COUNT); ++reason)
+            MQP_CHECK(processor.GetDropCount(1, static_cast<EDropReason>(reason)) == 0);
+    }
+
+    // Dense registry rejects keys out of its range, negative ones included, and takes the key again after DeleteQueue
+    void TestDenseKeys()
+    {
+        CCollector consumer;
+        CCollector recreated;
+        CMultiQueueProcessor<int, int, IConsumer<int>, SDenseKeys<8>> processor;
+        MQP_CHECK(!processor.CreateQueue(8));
+        MQP_CHECK(!processor.CreateQueue(-1));
+        MQP_CHECK(processor.CreateQueue(0));
+        MQP_CHECK(processor.CreateQueue(7));
+        MQP_CHECK(!processor.CreateQueue(7));
+
+        processor.Subscribe(-1, &consumer).wait();
+        processor.Subscribe(8, &consumer).wait();
+        processor.Enqueue(-1, 1);
+        processor.Enqueue(8, 2);
+        int value = 0;
+        MQP_CHECK(!processor.TryDequeue(-1, value));
+        MQP_CHECK(!processor.TryDequeue(8, value));
+
+        processor.Subscribe(7, &consumer).wait();
+        processor.Enqueue(7, 3);
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 3 }));
+
+        processor.DeleteQueue(7);
+        processor.Enqueue(7, 4);
+        MQP_CHECK(processor.CreateQueue(7));
+        processor.Subscribe(7, &recreated).wait();
+        processor.Enqueue(7, 5);
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(consumer.Values() == std::vector<int>({ 3 }));
+        MQP_CHECK(recreated.Values() == std::vector<int>({ 5 }));
+    }
+
+    // Throttled queue passes its burst at once and the rest at the rate, other queues are not slowed down
+    void TestRateLimit()
+    {
+        CCollector limited;
+        CCollector free;
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.rate_limit = 50;
+        options.rate_burst = 5;
+        MQP_CHECK(processor.CreateQueue(1, options));
+        MQP_CHECK(processor.CreateQueue(2));
+        processor.Subscribe(1, &limited);
+        processor.Subscribe(2, &free).wait();
+
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 20; ++i)
+        {
+            processor.Enqueue(1, i);
+            processor.Enqueue(2, i);
+        }
+        for (int i = 0; i < 1000 && free.Count() < 20; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        MQP_CHECK(free.Count() == 20);
+        MQP_CHECK(limited.Count() >= 5 && limited.Count() <= 5 + static_cast<size_t>(seconds * 50) + 1);
+
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(limited.Count() == 20);
+        MQP_CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(280));
+
+        processor.SetRateLimit(1, 0);
+        const auto unlimited = std::chrono::steady_clock::now();
+        for (int i = 0; i < 20; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(limited.Count() == 40);
+        MQP_CHECK(std::chrono::steady_clock::now() - unlimited < std::chrono::milliseconds(250));
+    }
+
+    // Consumer of several queues which records the queue of each consumed element
+    class CVisitRecorder
+    {
+    public:
+        class CQueueConsumer : public IConsumer<int>
+        {
+        public:
+            CQueueConsumer(CVisitRecorder& recorder, int id) : recorder(recorder), id(id) {}
+
+            void Consume(const int&) override
+            {
+                std::this_thread::sleep_for(recorder.delay);
+                std::lock_guard<std::mutex> lc{ recorder.mtx };
+                recorder.ids.push_back(id);
+            }
+
+        private:
+            CVisitRecorder& recorder;
+            int id;
+        };
+
+        explicit CVisitRecorder(std::chrono::milliseconds delay) : delay(delay) {}
+
+        // Number of times the processing thread has moved from one queue to another
+        size_t Switches()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            size_t count = 0;
+            for (size_t i = 1; i < ids.size(); ++i)
+                count += ids[i] != ids[i - 1] ? 1 : 0;
+            return count;
+        }
+
+    private:
+        std::mutex mtx;
+        std::vector<int> ids;
+        std::chrono::milliseconds delay;
+    };
+
+    // Consumes 10 elements of each of two queues with the scheduling options and returns the number of switches
+    size_t RunScheduling(const SSchedulingOptions& scheduling, std::chrono::milliseconds delay)
+    {
+        CVisitRecorder recorder(delay);
+        CVisitRecorder::CQueueConsumer first(recorder, 1);
+        CVisitRecorder::CQueueConsumer second(recorder, 2);
+        CMultiQueueProcessor<int, int> processor;
+        processor.SetSchedulingOptions(scheduling);
+        processor.StopProcessing();
+        MQP_CHECK(processor.CreateQueue(1));
+        MQP_CHECK(processor.CreateQueue(2));
+        processor.Subscribe(1, &first).wait();
+        processor.Subscribe(2, &second).wait();
+        for (int i = 0; i < 10; ++i)
+        {
+            processor.Enqueue(1, i);
+            processor.Enqueue(2, i);
+        }
+
+        processor.StartProcessing();
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        return recorder.Switches();
+    }
+
+    // One element per visit by default, max_batch elements per visit, quantum alone limits the visit by time only
+    void TestSchedulingOptions()
+    {
+        MQP_CHECK(RunScheduling(SSchedulingOptions(), std::chrono::milliseconds(0)) == 19);
+
+        SSchedulingOptions batch;
+        batch.max_batch = 5;
+        MQP_CHECK(RunScheduling(batch, std::chrono::milliseconds(0)) == 3);
+
+        SSchedulingOptions long_quantum;
+        long_quantum.quantum = std::chrono::seconds(10);
+        MQP_CHECK(RunScheduling(long_quantum, std::chrono::milliseconds(0)) == 1);
+
+        SSchedulingOptions short_quantum;
+        short_quantum.quantum = std::chrono::milliseconds(9);
+        const size_t switches = RunScheduling(short_quantum, std::chrono::milliseconds(2));
+        MQP_CHECK(switches > 1 && switches < 19);
+    }
+
+    // Consumer whose each call is longer than the watchdog threshold
+    class CSleepingCollector : public CCollector
+    {
+    public:
+        void Consume(const int& value) override
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            CCollector::Consume(value);
+        }
+    };
+
+    // Slow calls are reported, the queue of the slow consumer moves to the isolation thread and stops delaying the others
+    void TestWatchdog()
+    {
+        CSleepingCollector slow;
+        CCollector fast;
+        std::mutex mtx;
+        std::vector<std::pair<int, std::chrono::nanoseconds>> reports;
+        CMultiQueueProcessor<int, int> processor(1);
+        SWatchdogOptions<int> watchdog;
+        watchdog.threshold = std::chrono::milliseconds(10);
+        watchdog.isolate_after = 2;
+        watchdog.on_slow = [&mtx, &reports](int key, std::chrono::nanoseconds duration)
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            reports.emplace_back(key, duration);
+        };
+        processor.SetWatchdog(watchdog);
+        MQP_CHECK(processor.CreateQueue(1));
+        MQP_CHECK(processor.CreateQueue(2));
+        processor.Subscribe(1, &slow);
+        processor.Subscribe(2, &fast).wait();
+
+        for (int i = 0; i < 8; ++i)
+            processor.Enqueue(1, i);
+        for (int i = 0; i < 2000 && !processor.IsIsolated(1); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        MQP_CHECK(processor.IsIsolated(1));
+        MQP_CHECK(!processor.IsIsolated(2));
+
+        processor.Enqueue(2, 100);
+        for (int i = 0; i < 2000 && fast.Count() == 0; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        MQP_CHECK(fast.Count() == 1);
+        MQP_CHECK(slow.Count() < 8);
+
+        MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+        MQP_CHECK(slow.Values() == std::vector<int>({ 0, 1, 2, 3, 4, 5, 6, 7 }));
+        std::lock_guard<std::mutex> lc{ mtx };
+        MQP_CHECK(reports.size() >= 2);
+        for (const auto& report : reports)
+            MQP_CHECK(report.first == 1 && report.second >= std::chrono::milliseconds(10));
+    }
+
+    // Node of the page which holds the address or -1 if it is unknown
+    int PageNode(const void* ptr)
+    {
+#ifdef __linux__
+        const int MPOL_F_NODE_ADDR = 1 | 2;
+        int node = -1;
+        if (syscall(SYS_get_mempolicy, &node, nullptr, 0, const_cast<void*>(ptr), MPOL_F_NODE_ADDR) == 0)
+            return node;
+#else
+        (void)ptr;
+#endif
+        return -1;
+    }
+
+    // Storage placed on node 0 with each placement is usable and stays there when the queue grows
+    void TestNumaPlacement()
+    {
+        // No NUMA information on this platform
+        const std::vector<int> cpus = CAffinity::NodeCpus(0);
+        if (cpus.empty())
+            return;
+        MQP_CHECK(CAffinity::CpuNode(cpus.front()) == 0);
+        MQP_CHECK(CAffinity::NodeCpus(4096).empty());
+
+        const size_t bytes = 1 << 16;
+        for (ENumaPlacement placement : { ENumaPlacement::NONE, ENumaPlacement::FIRST_TOUCH, ENumaPlacement::BIND })
+        {
+            char* ptr = static_cast<char*>(CAffinity::Allocate(bytes, 0, placement));
+            MQP_CHECK(ptr != nullptr);
+            std::memset(ptr, 1, bytes);
+            const int node = PageNode(ptr + bytes - 1);
+            MQP_CHECK(node == -1 || node == 0);
+            CAffinity::Free(ptr, bytes, 0, placement);
+
+            CRingBuffer<int> ring(4, 0, placement);
+            for (int i = 0; i < 4; ++i)
+                ring.push(i);
+            ring.pop();
+            ring.reserve(64);
+            ring.push(4);
+            MQP_CHECK(ring.size() == 4 && ring.front() == 1 && ring.capacity() == 64);
+
+            CCollector consumer;
+            CMultiQueueProcessor<int, int> processor;
+            MQP_CHECK(processor.SetProcessorNode(0));
+            SQueueOptions<int> options;
+            options.capacity = 8;
+            options.numa_placement = placement;
+            MQP_CHECK(processor.CreateQueue(1, options));
+            processor.Subscribe(1, &consumer).wait();
+            std::vector<int> values;
+            for (int i = 0; i < 8; ++i)
+            {
+                values.push_back(i);
+                processor.Enqueue(1, i);
+            }
+            MQP_CHECK(processor.ReconfigureQueue(1, 32, EFullMode::SKIP_LAST));
+            MQP_CHECK(processor.Flush(std::chrono::seconds(5)));
+            MQP_CHECK(consumer.Values() == values);
+        }
+
+        // Binding to a missing node fails silently, the memory is still usable
+        char* ptr = static_cast<char*>(CAffinity::Allocate(bytes, 63, ENumaPlacement::BIND));
+        MQP_CHECK(ptr != nullptr);
+        std::memset(ptr, 1, bytes);
+        MQP_CHECK(ptr[bytes - 1] == 1);
+        CAffinity::Free(ptr, bytes, 63, ENumaPlacement::BIND);
+    }
+
+    // Queue without consumer is drained by the calling thread in batches or by waiting for each element
+    void TestPullDequeue()
+    {
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.skip_if_no_consumer = false;
+        MQP_CHECK(processor.CreateQueue(1, options));
+        options.partitions = 2;
+        options.partition_function = [](const int& value) { return static_cast<size_t>(value); };
+        MQP_CHECK(processor.CreateQueue(2, options));
+
+        std::vector<int> batch;
+        MQP_CHECK(processor.DequeueBatch(1, std::back_inserter(batch), 4) == 0);
+        for (int i = 0; i < 10; ++i)
+            processor.Enqueue(1, i);
+        MQP_CHECK(processor.DequeueBatch(1, std::back_inserter(batch), 4) == 4);
+        MQP_CHECK(batch == std::vector<int>({ 0, 1, 2, 3 }));
+        MQP_CHECK(processor.DequeueBatch(1, std::back_inserter(batch), 100) == 6);
+        MQP_CHECK(batch == std::vector<int>({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 }));
+
+        int value = -1;
+        auto start = std::chrono::steady_clock::now();
+        MQP_CHECK(!processor.WaitDequeue(1, value, std::chrono::milliseconds(20)));
+        MQP_CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+        MQP_CHECK(!processor.WaitDequeue(3, value, std::chrono::seconds(10)));
+
+        for (int id = 1; id <= 2; ++id)
+        {
+            start = std::chrono::steady_clock::now();
+            std::thread producer([&processor, id]()
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(30));
+                processor.Enqueue(id, 11);
+            });
+            MQP_CHECK(processor.WaitDequeue(id, value, std::chrono::seconds(5)));
+            MQP_CHECK(value == 11);
+            MQP_CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(25));
+            producer.join();
+        }
+        MQP_CHECK(processor.IsQuiescent());
+    }
+
+    // Element replaces the queued one with the same conflation key in place, the full queue takes it too
+    void TestConflation()
+    {
+        CMultiQueueProcessor<int, int> processor;
+        SQueueOptions<int> options;
+        options.capacity = 3;
+        options.skip_if_no_consumer = false;
+        options.conflation_key = [](const int& value) { return static_cast<uint64_t>(value / 100); };
+        MQP_CHECK(processor.CreateQueue(1, options));
+
+        for (int value : { 101, 201, 102, 301, 103, 202, 104 })
+            processor.Enqueue(1, value);
+        processor.Enqueue(1, 401);
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::CONFLATED) == 4);
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::QUEUE_FULL) == 1);
+
+        int value = 0;
+        MQP_CHECK(processor.TryDequeue(1, value) && value == 104);
+        processor.Enqueue(1, 105);
+        processor.Enqueue(1, 203);
+        std::vector<int> values;
+        MQP_CHECK(processor.DequeueBatch(1, std::back_inserter(values), 10) == 3);
+        MQP_CHECK(values == std::vector<int>({ 203, 301, 105 }));
+        MQP_CHECK(processor.GetDropCount(1, EDropReason::CONFLATED) == 5);
+
+        // Elements in the log can't be replaced in place
+        options.persistence.path = CMappedFile::TempPath("mqp_test_conflation");
+        MQP_CHECK(!processor.CreateQueue(2, options));
+        RemoveLog(options.persistence.path);
+    }
+
+    // Full DROP_FIRST queue doesn't evict the front element which is not visible yet, the new element is skipped
+    void TestDropFirstHidden()
+    {
+        std::atomic<uint64_t> watermark{ 0 };
+        CPQueue<int> queue(2, EFullMode::DROP_FIRST, false);
+        MQP_CHECK(queue.Reserve(1));
+        queue.PushReserved(7, 1, watermark);
+        queue.Push(8);
+        queue.Push(9);
+        MQP_CHECK(queue.GetDropCount(EDropReason::QUEUE_FULL) == 1);
+        MQP_CHECK(queue.GetDropCount(EDropReason::EVICTED) == 0);
+
+        int value = 0;
+        MQP_CHECK(!queue.TryPop(value));
+        watermark.store(1);
+        queue.Push(10);
+        MQP_CHECK(queue.GetDropCount(EDropReason::EVICTED) == 1);
+        MQP_CHECK(queue.TryPop(value) && value == 8);
+        MQP_CHECK(queue.TryPop(value) && value == 10);
+    }
+
+    // Histograms of an exited thread are in the next dump only, then they are reused
+    void TestLatencyTraceThreadExit()
+    {
+        // Processing threads of the other tests record too if tracing is compiled in
+        CLatencyTracer::Reset();
+        std::thread([]() { CLatencyTracer::Record(ETraceStage::LOOKUP, 0, 1000); }).join();
+        MQP_CHECK(CLatencyTracer::Collect(ETraceStage::LOOKUP)->Count() == 1);
+
+        std::ostringstream out;
+        CLatencyTracer::Dump(out);
+        MQP_CHECK(out.str().find("lookup 1 ") != std::string::npos);
+        MQP_CHECK(CLatencyTracer::Collect(ETraceStage::LOOKUP)->Count() == 0);
+
+        std::thread([]() { CLatencyTracer::Record(ETraceStage::LOOKUP, 0, 2000); }).join();
+        MQP_CHECK(CLatencyTracer::Collect(ETraceStage::LOOKUP)->Count() == 1);
+        MQP_CHECK(CLatencyTracer::Collect(ETraceStage::LOOKUP)->Max() == 2000);
+        CLatencyTracer::Reset();
+    }
+
+    // Ring of an exited thread is dumped once more, then it is cleared for the next thread
+    void TestEventTraceThreadExit()
+    {
+        int first = 0;
+        int second = 0;
+        // Keys which the other tests don't use, their threads record events too if the event trace is compiled in
+        CEventTrace::Reset();
+        std::thread([&first]() { CEventTrace::Record(ETraceEvent::QUEUE_CREATE, &first, 0x5151); }).join();
+
+        std::ostringstream dump;
+        CEventTrace::DumpChromeTrace(dump);
+        MQP_CHECK(dump.str().find("\"key\":20817}") != std::string::npos);
+
+        std::ostringstream next;
+        CEventTrace::DumpChromeTrace(next);
+        MQP_CHECK(next.str().find("\"key\":20817}") == std::string::npos);
+
+        std::thread([&second]() { CEventTrace::Record(ETraceEvent::QUEUE_CREATE, &second, 0x5152); }).join();
+        std::ostringstream last;
+        CEventTrace::DumpChromeTrace(last);
+        MQP_CHECK(last.str().find("\"key\":20818}") != std::string::npos);
+        MQP_CHECK(last.str().find("\"key\":20817}") == std::string::npos);
+    }
+
+#ifdef MQP_HAS_SHARED_MEMORY
+    // Consumer which holds the first element in place till it is released
+    class CBlockingConsumer : public IConsumer<int>
+    {
+    public:
+        void Consume(const int&) override
+        {
+            std::unique_lock<std::mutex> lc{ mtx };
+            ++count;
+            if (count == 1)
+            {
+                entered = true;
+                cv.notify_all();
+                cv.wait(lc, [this]() { return released; });
+            }
+        }
+
+        void WaitEntered()
+        {
+            std::unique_lock<std::mutex> lc{ mtx };
+            cv.wait(lc, [this]() { return entered; });
+        }
+
+        void Release()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            released = true;
+            cv.notify_all();
+        }
+
+        int Count()
+        {
+            std::lock_guard<std::mutex> lc{ mtx };
+            return count;
+        }
+
+    private:
+        std::mutex mtx;
+        std::condition_variable cv;
+        int count = 0;
+        bool entered = false;
+        bool released = false;
+    };
+
+    // The push to the full ring whose tail cell is consumed in place waits for it instead of evicting the queue
+    void TestSharedDropFirstInFlight()
+    {
+        SSharedMemoryOptions options;
+        options.max_queues = 4;
+        options.capacity = 8;
+        CSharedMultiQueueProcessor<int, int> processor("/mqp_test_" + std::to_string(getpid()), true, options);
+        MQP_CHECK(processor.IsReady());
+        MQP_CHECK(processor.CreateQueue(1, EFullMode::DROP_FIRST));
+
+        CBlockingConsumer consumer;
+        processor.Subscribe(1, &consumer);
+        for (int i = 0; i < 8; ++i)
+            MQP_CHECK(processor.Enqueue(1, i));
+        processor.StartProcessing();
+        consumer.WaitEntered();
+
+        std::thread producer([&processor]() { processor.Enqueue(1, 8); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        MQP_CHECK(processor.size(1) == 7);
+
+        consumer.Release();
+        producer.join();
+        for (int i = 0; i < 500 && consumer.Count() < 9; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        MQP_CHECK(consumer.Count() == 9);
+        processor.StopProcessing();
+    }
+#endif
+}
+
+int main()
+{
+    TestFlushAndDrain();
+    TestDrainOnShutdown();
+    TestFlushSkipsFutureTimers();
+    TestPauseResume();
+    TestReconfigure();
+    TestStaging();
+    TestStagingSizeOne();
+    TestEnqueueMulti();
+    TestSubscribeCallable();
+    TestFixedFullPolicy();
+    TestEnqueueMultiTtlAndConflation();
+    TestEnqueueMultiThrowingPush();
+    TestLatencyTraceThreadExit();
+    TestEventTraceThreadExit();
+    TestEnqueueAtOrder();
+    TestEnqueueAfterWaitQueue();
+    TestPartitionedWorkers();
+    TestPartitionedSpill();
+    TestPersistenceReplay();
+    TestLogError();
+    TestSpill();
+    TestDenseKeys();
+    TestRateLimit();
+    TestSchedulingOptions();
+    TestWatchdog();
+    TestNumaPlacement();
+    TestPullDequeue();
+    TestConflation();
+    TestDropFirstHidden();
+#ifdef MQP_HAS_SHARED_MEMORY
+    TestSharedDropFirstInFlight();
+#endif
+
+    if (TestFailures() == 0)
+        std::cout << "all checks passed" << std::endl;
+    return TestFailures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+// Compares CPQueue configured at runtime with the instantiations whose full policy and consumer type
+// are fixed at compile time. One thread pushes a batch of elements and consumes them, so the time per element
+// is the cost of the push and consume paths without contention.
+
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <iostream>
+#include "CPQueue.h"
+
+using namespace MultyQueueProcessor;
+
+namespace
+{
+    const size_t BATCH = 8;
+
+    class CVirtualCounter : public IConsumer<uint64_t>
+    {
+    public:
+        void Consume(const uint64_t& value) override
+        {
+            sum += value;
+        }
+
+        uint64_t sum = 0;
+    };
+
+    class CFinalCounter final
+    {
+    public:
+        void Consume(const uint64_t& value)
+        {
+            sum += value;
+        }
+
+        uint64_t sum = 0;
+    };
+
+    // Pushes one element more than the capacity in each batch, so the full queue path is taken too
+    template<typename Queue, typename Consumer>
+    double Run(EFullMode fm, uint64_t iterations)
+    {
+        Consumer consumer;
+        Queue queue(BATCH, fm);
+        queue.SetConsumer(&consumer);
+
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < iterations; i += BATCH)
+        {
+            for (uint64_t j = 0; j <= BATCH; ++j)
+                queue.Push(i + j);
+            while (queue.Consume())
+            {
+            }
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        if (consumer.sum == 0)
+            std::cout << "nothing consumed" << std::endl;
+        return std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(iterations);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const uint64_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10000000;
+
+    std::cout << "skip_last runtime:  " << Run<CPQueue<uint64_t>, CVirtualCounter>(EFullMode::SKIP_LAST, iterations) << " ns per element" << std::endl;
+    std::cout << "skip_last fixed:    " << Run<CPQueue<uint64_t, CFinalCounter, SSkipLast<>>, CFinalCounter>(EFullMode::SKIP_LAST, iterations) << " ns per element" << std::endl;
+    std::cout << "drop_first runtime: " << Run<CPQueue<uint64_t>, CVirtualCounter>(EFullMode::DROP_FIRST, iterations) << " ns per element" << std::endl;
+    std::cout << "drop_first fixed:   " << Run<CPQueue<uint64_t, CFinalCounter, SDropFirst<>>, CFinalCounter>(EFullMode::DROP_FIRST, iterations) << " ns per element" << std::endl;
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __RateLimiter_H__
+#define __RateLimiter_H__
+
+#include <chrono>
+#include <algorithm>
+
+namespace MultyQueueProcessor
+{
+    /**
+        \brief Token bucket which limits the rate of operations. The bucket is refilled with rate tokens per second
+         up to burst tokens, each operation takes one token. It is not thread safe.
+    */
+    class CTokenBucket
+    {
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        /**
+            Constructor of the token bucket
+            \param [in] rate - number of operations per second, 0 means no limit.
+            \param [in] burst - max number of operations which could be done at once, values less than 1 mean 1.
+        */
+        explicit CTokenBucket(double rate = 0, double burst = 1)
+        {
+            Reset(rate, burst);
+        }
+
+        /**
+            It changes the limit, the bucket becomes full.
+            \param [in] rate - number of operations per second, 0 means no limit.
+            \param [in] burst - max number of operations which could be done at once, values less than 1 mean 1.
+        */
+        void Reset(double rate, double burst)
+        {
+            tokens_per_second = rate > 0 ? rate : 0;
+            capacity = std::max(burst, 1.0);
+            tokens = capacity;
+            last = Clock::now();
+        }
+
+        /// \return true if the bucket limits operations
+        bool IsLimited() const
+        {
+            return tokens_per_second > 0;
+        }
+
+        /**
+            It takes one token if it is available.
+            \param [in] now - current time.
+            \return true if the operation is allowed or false in other way.
+        */
+        bool TryAcquire(Clock::time_point now)
+        {
+            if (!IsLimited())
+                return true;
+
+            Refill(now);
+            if (tokens < 1)
+                return false;
+
+            tokens -= 1;
+            return true;
+        }
+
+        /**
+            \param [in] now - current time.
+            \return time when the next token becomes available.
+        */
+        Clock::time_point NextAvailable(Clock::time_point now)
+        {
+            if (!IsLimited())
+                return now;
+
+            Refill(now);
+            if (tokens >= 1)
+                return now;
+
+            const std::chrono::duration<double> wait((1 - tokens) / tokens_per_second);
+            return now + std::chrono::duration_cast<Clock::duration>(wait) + Clock::duration(1);
+        }
+
+    private:
+        void Refill(Clock::time_point now)
+        {
+            if (now <= last)
+                return;
+
+            const std::chrono::duration<double> elapsed = now - last;
+            tokens = std::min(capacity, tokens + elapsed.count() * tokens_per_second);
+            last = now;
+        }
+
+    private:
+        double tokens_per_second = 0;
+        double capacity = 1;
+        double tokens = 1;
+        Clock::time_point last;
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __RateLimiter_H__
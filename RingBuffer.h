@@ -0,0 +1,133 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __RingBuffer_H__
+#define __RingBuffer_H__
+
+#include <utility>
+#include <cassert>
+#include "Affinity.h"
+
+namespace MultyQueueProcessor
+{
+    /**
+        \brief Fixed capacity FIFO container with preallocated contiguous storage.
+         The storage could be placed on the certain NUMA node. It is not thread safe.
+    */
+    template<typename T>
+    class CRingBuffer
+    {
+    public:
+        /**
+            Constructor of the ring buffer
+            \param [in] capacity - max number of elements.
+            \param [in] node - index of NUMA node for the storage or -1 for default allocation.
+            \param [in] placement - value from ENumaPlacement enum.
+        */
+        explicit CRingBuffer(size_t capacity, int node = -1, ENumaPlacement placement = ENumaPlacement::NONE) :
+            numa_node(node),
+            numa_placement(placement)
+        {
+            Allocate(capacity);
+        }
+
+        ~CRingBuffer()
+        {
+            clear();
+            CAffinity::Free(data, cap * sizeof(T), numa_node, numa_placement);
+        }
+
+        CRingBuffer(const CRingBuffer&) = delete;
+        CRingBuffer& operator=(const CRingBuffer&) = delete;
+
+        void push(const T& value)
+        {
+            assert(count < cap);
+            new (data + Index(count)) T(value);
+            ++count;
+        }
+
+        void push(T&& value)
+        {
+            assert(count < cap);
+            new (data + Index(count)) T(std::move(value));
+            ++count;
+        }
+
+        void pop()
+        {
+            assert(count > 0);
+            data[head].~T();
+            head = head + 1 == cap ? 0 : head + 1;
+            --count;
+        }
+
+        T& front() { return data[head]; }
+        const T& front() const { return data[head]; }
+
+        /// Access to element by its position from the front
+        T& operator[](size_t pos) { return data[Index(pos)]; }
+        const T& operator[](size_t pos) const { return data[Index(pos)]; }
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        size_t capacity() const { return cap; }
+
+        void clear()
+        {
+            while (count > 0)
+                pop();
+            head = 0;
+        }
+
+        /**
+            It changes capacity of the buffer keeping its elements. The storage stays on the same NUMA node.
+            \param [in] capacity - new capacity, it should not be less than the current size.
+        */
+        void reserve(size_t capacity)
+        {
+            assert(capacity >= count);
+            T* old_data = data;
+            const size_t old_cap = cap;
+            const size_t old_head = head;
+            const size_t old_count = count;
+
+            Allocate(capacity);
+            for (size_t i = 0; i < old_count; ++i)
+            {
+                T& value = old_data[(old_head + i) % old_cap];
+                new (data + i) T(std::move(value));
+                value.~T();
+            }
+            count = old_count;
+
+            CAffinity::Free(old_data, old_cap * sizeof(T), numa_node, numa_placement);
+        }
+
+    private:
+        size_t Index(size_t pos) const
+        {
+            const size_t index = head + pos;
+            return index < cap ? index : index - cap;
+        }
+
+        void Allocate(size_t capacity)
+        {
+            data = static_cast<T*>(CAffinity::Allocate(capacity * sizeof(T), numa_node, numa_placement));
+            cap = capacity;
+            head = 0;
+            count = 0;
+        }
+
+    private:
+        T* data = nullptr;
+        size_t cap = 0;
+        size_t head = 0;
+        size_t count = 0;
+        int numa_node;
+        ENumaPlacement numa_placement;
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __RingBuffer_H__
@@ -0,0 +1,581 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __SegmentLog_H__
+#define __SegmentLog_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MQP_HAS_MAPPED_FILES 1
+#endif
+
+namespace MultyQueueProcessor
+{
+    /// Defines when the log is flushed to disk
+    enum class EFsyncPolicy : int
+    {
+        NONE,      /// Never flush explicitly, the data is written back by the OS
+        PERIODIC,  /// Flush at the end of batch if fsync_interval has passed since the previous flush
+        PER_BATCH  /// Flush at the end of every batch
+    };
+
+    /**
+        \brief Settings of the segment log.
+    */
+    struct SLogOptions
+    {
+        std::string path;                                   /// Path prefix of the log files, empty path disables the log
+        EFsyncPolicy fsync_policy = EFsyncPolicy::PERIODIC; /// When the log is flushed to disk
+        std::chrono::milliseconds fsync_interval{ 100 };    /// Interval for EFsyncPolicy::PERIODIC
+        size_t segment_size = 16 * 1024 * 1024;             /// Size of one segment file
+    };
+
+    /**
+        \brief Memory-mapped file. It is implemented for POSIX systems only, on other platforms Open fails.
+    */
+    class CMappedFile
+    {
+    public:
+        CMappedFile() {}
+        ~CMappedFile() { Close(); }
+
+        CMappedFile(const CMappedFile&) = delete;
+        CMappedFile& operator=(const CMappedFile&) = delete;
+
+        /**
+            It opens or creates the file and maps it to memory.
+            \param [in] file_path - path of the file.
+            \param [in] size - min size of the file, smaller file is extended with zeros.
+            \return true if the file has been mapped or false in other way.
+        */
+        bool Open(const std::string& file_path, size_t size)
+        {
+#ifdef MQP_HAS_MAPPED_FILES
+            const int fd = ::open(file_path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0)
+                return false;
+
+            struct stat st;
+            bool result = fstat(fd, &st) == 0;
+            if (result && static_cast<size_t>(st.st_size) < size)
+            {
+                result = ftruncate(fd, static_cast<off_t>(size)) == 0;
+            }
+            else
+            {
+                size = static_cast<size_t>(st.st_size);
+            }
+
+            if (result)
+            {
+                void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                result = ptr != MAP_FAILED;
+                if (result)
+                {
+                    data = static_cast<char*>(ptr);
+                    length = size;
+                }
+            }
+
+            ::close(fd);
+            return result;
+#else
+            (void)file_path;
+            (void)size;
+            return false;
+#endif
+        }
+
+        void Close()
+        {
+#ifdef MQP_HAS_MAPPED_FILES
+            if (data)
+                munmap(data, length);
+#endif
+            data = nullptr;
+            length = 0;
+        }
+
+        /**
+            It flushes the range of the mapped file to disk.
+        */
+        void Sync(size_t offset, size_t size)
+        {
+#ifdef MQP_HAS_MAPPED_FILES
+            if (data == nullptr || size == 0)
+                return;
+
+            const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            const size_t begin = offset / page * page;
+            msync(data + begin, std::min(offset + size, length) - begin, MS_SYNC);
+#else
+            (void)offset;
+            (void)size;
+#endif
+        }
+
+        char* Data() const { return data; }
+        size_t Size() const { return length; }
+
+        /**
+            It returns unique path prefix for temporary files of this process.
+            \param [in] name - first part of the file name.
+        */
+        static std::string TempPath(const std::string& name)
+        {
+            static std::atomic<unsigned> counter{ 0 };
+            const char* dir = std::getenv("TMPDIR");
+            std::string path = dir && *dir ? dir : "/tmp";
+#ifdef MQP_HAS_MAPPED_FILES
+            path += "/" + name + "_" + std::to_string(getpid());
+#else
+            path += "/" + name;
+#endif
+            return path + "_" + std::to_string(counter++);
+        }
+
+        static void Remove(const std::string& file_path)
+        {
+            std::remove(file_path.c_str());
+        }
+
+        /**
+            It returns names of files in the directory.
+        */
+        static std::vector<std::string> List(const std::string& dir)
+        {
+            std::vector<std::string> names;
+#ifdef MQP_HAS_MAPPED_FILES
+            DIR* d = opendir(dir.c_str());
+            if (d == nullptr)
+                return names;
+
+            while (dirent* entry = readdir(d))
+            {
+                names.push_back(entry->d_name);
+            }
+            closedir(d);
+#else
+            (void)dir;
+#endif
+            return names;
+        }
+
+    private:
+        char* data = nullptr;
+        size_t length = 0;
+    };
+
+    /**
+        \brief Append-only log of records stored in memory-mapped segment files <path>.<index>.seg.
+         It has three cursors: write position, read position of the next record which is not loaded by the reader yet
+         and commit position of the first record which is not consumed yet. Durable log stores the commit position
+         in <path>.offset file and replays records after it on Open. Not durable log is a temporary storage,
+         its records are consumed as soon as they are read and its files are removed on destruction.
+         Segments before the commit position are removed. The log is not thread safe.
+    */
+    class CSegmentLog
+    {
+        struct SPosition
+        {
+            uint32_t segment = 0;
+            uint32_t offset = 0;
+        };
+
+        struct SRecordHeader
+        {
+            uint32_t size;
+            uint32_t checksum;
+            uint64_t meta;
+        };
+
+        static const uint32_t SKIP_MARKER = 0xFFFFFFFF;
+
+    public:
+        /**
+            Constructor of the log
+            \param [in] options - settings of the log, see SLogOptions.
+            \param [in] durable - true if the log should survive restarts.
+        */
+        CSegmentLog(const SLogOptions& options, bool durable) : options(options), durable(durable) {}
+
+        ~CSegmentLog()
+        {
+            segments.clear();
+            if (!durable && opened)
+            {
+                for (uint32_t index = first_segment; index <= write.segment; ++index)
+                    CMappedFile::Remove(SegmentPath(index));
+            }
+        }
+
+        CSegmentLog(const CSegmentLog&) = delete;
+        CSegmentLog& operator=(const CSegmentLog&) = delete;
+
+        /**
+            It opens the log. Durable log finds records which are not committed yet, not durable one removes old files.
+            \return true if the log has been opened or false in other way.
+        */
+        bool Open()
+        {
+            std::vector<uint32_t> existing = ListSegments();
+            if (!durable)
+            {
+                for (uint32_t index : existing)
+                    CMappedFile::Remove(SegmentPath(index));
+                existing.clear();
+            }
+
+            first_segment = existing.empty() ? 0 : existing.front();
+            last_segment = existing.empty() ? 0 : existing.back();
+
+            if (durable)
+            {
+                if (!offset_file.Open(options.path + ".offset", sizeof(uint64_t)))
+                    return false;
+
+                uint64_t packed = 0;
+                std::memcpy(&packed, offset_file.Data(), sizeof(packed));
+                commit.segment = static_cast<uint32_t>(packed >> 32);
+                commit.offset = static_cast<uint32_t>(packed);
+                if (existing.empty() || commit.segment < first_segment)
+                {
+                    commit = SPosition{};
+                    commit.segment = first_segment;
+                }
+                ReleaseBefore(commit.segment);
+            }
+
+            if (Segment(first_segment) == nullptr)
+                return false;
+
+            // Find the end of valid records after the commit position
+            SPosition pos = commit;
+            while (Normalize(pos, last_segment))
+            {
+                SRecordHeader header;
+                if (!ReadHeader(pos, header) || !IsValid(pos, header))
+                    break;
+
+                pos.offset += static_cast<uint32_t>(RecordSize(header.size));
+                ++pending;
+            }
+
+            write = pos;
+            read = commit;
+            synced = write.offset;
+            opened = true;
+            return true;
+        }
+
+        /**
+            It appends new record to the log.
+            \param [in] data - payload of the record.
+            \param [in] size - size of payload.
+            \param [in] meta - user defined value stored with the record.
+            \param [in] loaded - true if the reader has already got the record, so the read position skips it.
+            \return true if the record has been appended or false if it doesn't fit to segment or file can't be created.
+        */
+        bool Append(const char* data, size_t size, uint64_t meta, bool loaded)
+        {
+            const size_t record_size = RecordSize(size);
+            if (record_size > options.segment_size)
+                return false;
+
+            CMappedFile* file = Segment(write.segment);
+            if (file == nullptr)
+                return false;
+
+            if (write.offset + record_size > file->Size())
+            {
+                if (write.offset + sizeof(SRecordHeader) <= file->Size())
+                {
+                    SRecordHeader skip{ SKIP_MARKER, 0, 0 };
+                    std::memcpy(file->Data() + write.offset, &skip, sizeof(skip));
+                }
+
+                if (options.fsync_policy != EFsyncPolicy::NONE)
+                    Sync();
+
+                write.segment += 1;
+                write.offset = 0;
+                synced = 0;
+                file = Segment(write.segment);
+                if (file == nullptr)
+                    return false;
+            }
+
+            SRecordHeader header{ static_cast<uint32_t>(size), 0, meta };
+            header.checksum = Checksum(header, data);
+            std::memcpy(file->Data() + write.offset + sizeof(header), data, size);
+            std::memcpy(file->Data() + write.offset, &header, sizeof(header));
+            write.offset += static_cast<uint32_t>(record_size);
+
+            if (loaded)
+            {
+                read = write;
+            }
+            else
+            {
+                ++pending;
+            }
+            return true;
+        }
+
+        /**
+            It reads the record at the read position without moving the position.
+            \param [out] data - payload of the record.
+            \param [out] meta - user defined value stored with the record.
+            \return true if the record has been read or false if there are no pending records.
+        */
+        bool Peek(std::string& data, uint64_t& meta)
+        {
+            if (pending == 0 || !Normalize(read, write.segment))
+                return false;
+
+            SRecordHeader header;
+            ReadHeader(read, header);
+            data.assign(Segment(read.segment)->Data() + read.offset + sizeof(header), header.size);
+            meta = header.meta;
+            return true;
+        }
+
+        /**
+            It moves the read position to the next record.
+        */
+        void Skip()
+        {
+            if (pending == 0 || !Normalize(read, write.segment))
+                return;
+
+            SRecordHeader header;
+            ReadHeader(read, header);
+            read.offset += static_cast<uint32_t>(RecordSize(header.size));
+            --pending;
+
+            if (!durable)
+                ReleaseBefore(read.segment);
+        }
+
+        /**
+            It marks the first not consumed record as consumed. It does nothing for not durable log.
+        */
+        void Commit()
+        {
+            if (!durable || !Normalize(commit, write.segment))
+                return;
+
+            SRecordHeader header;
+            ReadHeader(commit, header);
+            commit.offset += static_cast<uint32_t>(RecordSize(header.size));
+            StoreCommit();
+        }
+
+        /**
+            It marks all records as consumed.
+        */
+        void CommitAll()
+        {
+            read = write;
+            pending = 0;
+            if (durable)
+            {
+                commit = write;
+                StoreCommit();
+            }
+            else
+            {
+                ReleaseBefore(read.segment);
+            }
+        }
+
+        /**
+            It ends the batch of changes and flushes them to disk according to fsync policy.
+        */
+        void Flush()
+        {
+            if (!durable || options.fsync_policy == EFsyncPolicy::NONE)
+                return;
+
+            const auto now = std::chrono::steady_clock::now();
+            if (options.fsync_policy == EFsyncPolicy::PER_BATCH || now - last_sync >= options.fsync_interval)
+            {
+                Sync();
+                last_sync = now;
+            }
+        }
+
+        /// Number of records after the read position
+        size_t Pending() const { return pending; }
+
+    private:
+        static size_t RecordSize(size_t size)
+        {
+            return (sizeof(SRecordHeader) + size + 7) & ~static_cast<size_t>(7);
+        }
+
+        // FNV-1a of the header and payload, zero is reserved for unwritten space
+        static uint32_t Checksum(const SRecordHeader& header, const char* data)
+        {
+            uint32_t hash = 2166136261u;
+            auto add = [&hash](const char* bytes, size_t size)
+            {
+                for (size_t i = 0; i < size; ++i)
+                {
+                    hash ^= static_cast<unsigned char>(bytes[i]);
+                    hash *= 16777619u;
+                }
+            };
+            add(reinterpret_cast<const char*>(&header.size), sizeof(header.size));
+            add(reinterpret_cast<const char*>(&header.meta), sizeof(header.meta));
+            add(data, header.size);
+            return hash | 1;
+        }
+
+        std::string SegmentPath(uint32_t index) const
+        {
+            char suffix[32];
+            std::snprintf(suffix, sizeof(suffix), ".%010u.seg", index);
+            return options.path + suffix;
+        }
+
+        std::vector<uint32_t> ListSegments() const
+        {
+            const size_t slash = options.path.find_last_of("/\\");
+            const std::string dir = slash == std::string::npos ? "." : options.path.substr(0, slash + 1);
+            const std::string base = slash == std::string::npos ? options.path : options.path.substr(slash + 1);
+
+            std::vector<uint32_t> indices;
+            for (const std::string& name : CMappedFile::List(dir))
+            {
+                const size_t digits = 10;
+                if (name.size() == base.size() + digits + 5 && name.compare(0, base.size() + 1, base + ".") == 0
+                    && name.compare(name.size() - 4, 4, ".seg") == 0)
+                {
+                    indices.push_back(static_cast<uint32_t>(std::strtoul(name.c_str() + base.size() + 1, nullptr, 10)));
+                }
+            }
+            std::sort(indices.begin(), indices.end());
+            return indices;
+        }
+
+        CMappedFile* Segment(uint32_t index)
+        {
+            auto it = segments.find(index);
+            if (it != segments.end())
+                return it->second.get();
+
+            std::unique_ptr<CMappedFile> file(new CMappedFile());
+            if (!file->Open(SegmentPath(index), options.segment_size))
+                return nullptr;
+
+            last_segment = std::max(last_segment, index);
+            return segments.emplace(index, std::move(file)).first->second.get();
+        }
+
+        // Moves the position to the next segment if the current one has no more records, returns false after last segment
+        bool Normalize(SPosition& pos, uint32_t last)
+        {
+            while (pos.segment <= last)
+            {
+                CMappedFile* file = Segment(pos.segment);
+                if (file == nullptr)
+                    return false;
+
+                SRecordHeader header;
+                if (pos.offset + sizeof(SRecordHeader) <= file->Size())
+                {
+                    std::memcpy(&header, file->Data() + pos.offset, sizeof(header));
+                    if (header.size != SKIP_MARKER)
+                        return true;
+                }
+
+                pos.segment += 1;
+                pos.offset = 0;
+            }
+            return false;
+        }
+
+        bool ReadHeader(const SPosition& pos, SRecordHeader& header)
+        {
+            CMappedFile* file = Segment(pos.segment);
+            if (file == nullptr || pos.offset + sizeof(SRecordHeader) > file->Size())
+                return false;
+
+            std::memcpy(&header, file->Data() + pos.offset, sizeof(header));
+            return true;
+        }
+
+        bool IsValid(const SPosition& pos, const SRecordHeader& header)
+        {
+            CMappedFile* file = Segment(pos.segment);
+            return header.checksum != 0 && pos.offset + RecordSize(header.size) <= file->Size()
+                && header.checksum == Checksum(header, file->Data() + pos.offset + sizeof(SRecordHeader));
+        }
+
+        void StoreCommit()
+        {
+            ReleaseBefore(commit.segment);
+            const uint64_t packed = (static_cast<uint64_t>(commit.segment) << 32) | commit.offset;
+            std::memcpy(offset_file.Data(), &packed, sizeof(packed));
+        }
+
+        // Removes segments which are completely consumed
+        void ReleaseBefore(uint32_t segment)
+        {
+            for (; first_segment < segment; ++first_segment)
+            {
+                segments.erase(first_segment);
+                CMappedFile::Remove(SegmentPath(first_segment));
+            }
+        }
+
+        void Sync()
+        {
+            auto it = segments.find(write.segment);
+            if (it != segments.end() && write.offset > synced)
+            {
+                it->second->Sync(synced, write.offset - synced);
+                synced = write.offset;
+            }
+            offset_file.Sync(0, sizeof(uint64_t));
+        }
+
+    private:
+        SLogOptions options;
+        bool durable;
+        bool opened = false;
+
+        std::map<uint32_t, std::unique_ptr<CMappedFile>> segments;
+        CMappedFile offset_file;
+        uint32_t first_segment = 0;
+        uint32_t last_segment = 0;
+
+        SPosition write;
+        SPosition read;
+        SPosition commit;
+        size_t pending = 0;
+
+        uint32_t synced = 0;
+        std::chrono::steady_clock::time_point last_sync;
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __SegmentLog_H__
@@ -0,0 +1,67 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __Serializer_H__
+#define __Serializer_H__
+
+#include <string>
+#include <cstring>
+#include <type_traits>
+
+namespace MultyQueueProcessor
+{
+    /**
+        \brief Serialization hook which is used to store queue elements in files.
+         It is implemented for trivially copyable types and std::string. Other types should specialize it,
+         the specialization has to define supported = true, Serialize and Deserialize with the same signatures.
+         Deserialized type has to be default constructible.
+    */
+    template<typename T, typename Enable = void>
+    struct CSerializer
+    {
+        static const bool supported = false;
+
+        static void Serialize(const T&, std::string&) {}
+        static bool Deserialize(const char*, size_t, T&) { return false; }
+    };
+
+    template<typename T>
+    struct CSerializer<T, typename std::enable_if<std::is_trivially_copyable<T>::value && std::is_default_constructible<T>::value>::type>
+    {
+        static const bool supported = true;
+
+        static void Serialize(const T& value, std::string& out)
+        {
+            out.assign(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        static bool Deserialize(const char* data, size_t size, T& value)
+        {
+            if (size != sizeof(T))
+                return false;
+
+            std::memcpy(&value, data, sizeof(T));
+            return true;
+        }
+    };
+
+    template<>
+    struct CSerializer<std::string>
+    {
+        static const bool supported = true;
+
+        static void Serialize(const std::string& value, std::string& out)
+        {
+            out = value;
+        }
+
+        static bool Deserialize(const char* data, size_t size, std::string& value)
+        {
+            value.assign(data, size);
+            return true;
+        }
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __Serializer_H__
@@ -0,0 +1,625 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __CSharedMultiQueueProcessor_H__
+#define __CSharedMultiQueueProcessor_H__
+
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <type_traits>
+#include <climits>
+#include "CPQueue.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MQP_HAS_SHARED_MEMORY 1
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace MultyQueueProcessor
+{
+    /**
+        \brief Settings of the shared memory segment. They are used only by the process which creates the segment.
+    */
+    struct SSharedMemoryOptions
+    {
+        size_t max_queues = 64;        /// Max number of queues in the segment
+        size_t capacity = MAX_CAPACITY; /// Max number of elements in each queue
+    };
+
+    /**
+        \brief The CSharedMultiQueueProcessor is a variant of CMultiQueueProcessor for several processes on the same host.
+               The queue registry and the ring storage of all queues live in a POSIX shared memory segment, so producers
+               in one process enqueue by key and the processor in another process consumes the elements in place.
+               Each queue is a bounded lock-free ring, wakeups go through process-shared futexes on Linux
+               and through short sleeps on other POSIX systems.
+               KeyType and ValueType should be trivially copyable, std::hash<KeyType> should give the same values
+               in all processes. EFullMode::SPILL is not supported. Only one process should subscribe to each queue.
+               Unlike CMultiQueueProcessor, the internal thread is started by StartProcessing only,
+               so producer processes don't need it.
+    */
+    template<typename KeyType, typename ValueType>
+    class CSharedMultiQueueProcessor
+    {
+        static_assert(std::is_trivially_copyable<KeyType>::value, "KeyType should be trivially copyable");
+        static_assert(std::is_trivially_copyable<ValueType>::value, "ValueType should be trivially copyable");
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word should be plain 32 bit integer");
+
+        static const uint64_t MAGIC = 0x4D51505348415245ULL; // "MQPSHARE"
+        static const uint32_t VERSION = 1;
+
+        enum ESlotState : uint32_t
+        {
+            FREE = 0,
+            READY = 1,
+            DELETED = 2
+        };
+
+        struct SHeader
+        {
+            std::atomic<uint64_t> magic;
+            uint32_t version;
+            uint32_t key_size;
+            uint32_t value_size;
+            uint32_t max_queues;
+            uint32_t capacity;
+            std::atomic<uint32_t> registry_lock;
+
+            alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> data_seq;
+            std::atomic<uint32_t> consumer_waiting;
+
+            alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> space_seq;
+            std::atomic<uint32_t> space_waiters;
+        };
+
+        struct SSlot
+        {
+            alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> state;
+            EFullMode full_mode;
+            KeyType key;
+
+            alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> enqueue_pos;
+            alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> dequeue_pos;
+        };
+
+        struct SCell
+        {
+            std::atomic<uint64_t> sequence;
+            ValueType value;
+        };
+
+    public:
+        /**
+            Constructor of the processor
+            \param [in] name - name of the shared memory segment, for example "/my_queues".
+            \param [in] create - true if the segment should be created, it fails if the segment already exists.
+            \param [in] options - settings of the created segment, see SSharedMemoryOptions.
+        */
+        CSharedMultiQueueProcessor(const std::string& name, bool create, const SSharedMemoryOptions& options = SSharedMemoryOptions())
+            : name(name), owner(create)
+        {
+            ready = create ? Create(options) : Attach();
+        }
+
+        ~CSharedMultiQueueProcessor()
+        {
+            StopProcessing();
+
+#ifdef MQP_HAS_SHARED_MEMORY
+            if (memory)
+                munmap(memory, memory_size);
+            if (owner && ready)
+                shm_unlink(name.c_str());
+#endif
+        }
+
+        CSharedMultiQueueProcessor(const CSharedMultiQueueProcessor&) = delete;
+        CSharedMultiQueueProcessor& operator=(const CSharedMultiQueueProcessor&) = delete;
+
+        /**
+            \return false if the shared memory segment could not be created or attached, such processor should not be used.
+        */
+        bool IsReady() const
+        {
+            return ready;
+        }
+
+        /**
+            It starts internal thread to process the queues subscribed in this process.
+        */
+        void StartProcessing()
+        {
+            if (!running && ready)
+            {
+                running = true;
+                th = std::thread(std::bind(&CSharedMultiQueueProcessor::Process, this));
+            }
+        }
+
+        /**
+            It stops internal thread and waits for it.
+        */
+        void StopProcessing()
+        {
+            if (running)
+            {
+                running = false;
+                header->data_seq.fetch_add(1);
+                FutexWake(header->data_seq, INT_MAX);
+            }
+
+            if (th.joinable())
+                th.join();
+        }
+
+        /**
+            It creates certain queue in shared memory, it becomes visible for all processes.
+            \param [in] id - unique id for the queue to create.
+            \param [in] fm - value from EFullMode enum, EFullMode::SPILL is not supported.
+            \return  - true if the queue has been created or false in other way.
+        */
+        bool CreateQueue(KeyType id, EFullMode fm = EFullMode::SKIP_LAST)
+        {
+            if (!ready || fm == EFullMode::SPILL)
+                return false;
+
+            CRegistryLock lock(header->registry_lock);
+            if (FindSlot(id) != nullptr)
+                return false;
+
+            const size_t start = std::hash<KeyType>()(id) % header->max_queues;
+            for (size_t i = 0; i < header->max_queues; ++i)
+            {
+                const size_t index = (start + i) % header->max_queues;
+                SSlot* slot = Slot(index);
+                if (slot->state.load(std::memory_order_acquire) != READY)
+                {
+                    slot->full_mode = fm;
+                    slot->key = id;
+                    slot->enqueue_pos.store(0, std::memory_order_relaxed);
+                    slot->dequeue_pos.store(0, std::memory_order_relaxed);
+                    SCell* cells = Cells(index);
+                    for (size_t c = 0; c < header->capacity; ++c)
+                        cells[c].sequence.store(c, std::memory_order_relaxed);
+
+                    slot->state.store(READY, std::memory_order_release);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+            It deletes certain queue. Producers should not use the queue at this moment.
+            \param [in] id - unique id of the certain queue.
+        */
+        void DeleteQueue(KeyType id)
+        {
+            if (!ready)
+                return;
+
+            Unsubscribe(id);
+            CRegistryLock lock(header->registry_lock);
+            SSlot* slot = FindSlot(id);
+            if (slot)
+                slot->state.store(DELETED, std::memory_order_release);
+        }
+
+        /**
+            It adds consumer of this process to processing certain queue.
+            \param [in] id - unique id of the certain queue.
+            \param [in] consumer - certain consumer, derived from IConsumer interface.
+        */
+        void Subscribe(KeyType id, IConsumer<ValueType>* consumer)
+        {
+            {
+                std::lock_guard<std::mutex> lc{ subscriptions_mtx };
+                subscriptions[id] = consumer;
+            }
+
+            if (ready)
+            {
+                header->data_seq.fetch_add(1);
+                FutexWake(header->data_seq, INT_MAX);
+            }
+        }
+
+        /**
+            It removes consumer from processing certain queue.
+            \param [in] id - unique id of the certain queue.
+        */
+        void Unsubscribe(KeyType id)
+        {
+            std::lock_guard<std::mutex> lc{ subscriptions_mtx };
+            subscriptions.erase(id);
+        }
+
+        /**
+            It puts new element to certain queue, the queue could be consumed by another process.
+            \param [in] id - unique id of the certain queue.
+            \param [in] value - element which should be put in queue.
+            \return true if the element has been put or false if the queue doesn't exist or it is full in SKIP_LAST mode.
+        */
+        bool Enqueue(KeyType id, const ValueType& value)
+        {
+            if (!ready)
+                return false;
+
+            SSlot* slot = FindSlot(id);
+            if (slot == nullptr)
+                return false;
+
+            SCell* cells = Cells(SlotIndex(slot));
+            bool evicted = false;
+            while (!TryPush(slot, cells, value))
+            {
+                if (slot->full_mode == EFullMode::SKIP_LAST)
+                {
+                    return false;
+                }
+
+                // The push evicts one element at most between waits. If the queue is not full, the tail cell is still
+                // held by the consumer in place and the producer waits till it is released
+                if (slot->full_mode == EFullMode::DROP_FIRST && !evicted && Count(slot) >= header->capacity)
+                {
+                    evicted = TryPop(slot, cells, [](const ValueType&) {});
+                    if (evicted)
+                        continue;
+                }
+
+                WaitForSpace(slot, cells);
+                evicted = false;
+            }
+
+            header->data_seq.fetch_add(1);
+            if (header->consumer_waiting.load() != 0)
+                FutexWake(header->data_seq, INT_MAX);
+            return true;
+        }
+
+        /**
+            \return number of elements in certain queue or 0 if the queue doesn't exist.
+        */
+        size_t size(KeyType id) const
+        {
+            SSlot* slot = ready ? FindSlot(id) : nullptr;
+            return slot ? Count(slot) : 0;
+        }
+
+    protected:
+        void Process()
+        {
+            while (running)
+            {
+                const uint32_t seq = header->data_seq.load();
+                if (ProcessPass())
+                    continue;
+
+                header->consumer_waiting.store(1);
+                // Elements pushed after seq has been read change data_seq, so the wait returns immediately
+                if (running && !ProcessPass())
+                {
+                    FutexWait(header->data_seq, seq, std::chrono::milliseconds(100));
+                }
+                header->consumer_waiting.store(0);
+            }
+        }
+
+        // Consumes one element from each subscribed queue, returns true if anything has been consumed
+        bool ProcessPass()
+        {
+            bool consumed = false;
+            std::lock_guard<std::mutex> lc{ subscriptions_mtx };
+            for (auto& subscription : subscriptions)
+            {
+                SSlot* slot = FindSlot(subscription.first);
+                if (slot == nullptr)
+                    continue;
+
+                IConsumer<ValueType>* consumer = subscription.second;
+                consumed |= TryPop(slot, Cells(SlotIndex(slot)), [consumer](const ValueType& value) { consumer->Consume(value); });
+            }
+            return consumed;
+        }
+
+        // Bounded MPMC ring, each cell sequence tells whose turn is it: producer of position or consumer of position
+        bool TryPush(SSlot* slot, SCell* cells, const ValueType& value)
+        {
+            uint64_t pos = slot->enqueue_pos.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                SCell& cell = cells[pos % header->capacity];
+                const uint64_t seq = cell.sequence.load(std::memory_order_acquire);
+                const int64_t diff = static_cast<int64_t>(seq - pos);
+                if (diff == 0)
+                {
+                    if (slot->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        cell.value = value;
+                        cell.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = slot->enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // The element is passed to handler in place and the cell is released after it
+        template<typename Handler>
+        bool TryPop(SSlot* slot, SCell* cells, Handler&& handler)
+        {
+            uint64_t pos = slot->dequeue_pos.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                SCell& cell = cells[pos % header->capacity];
+                const uint64_t seq = cell.sequence.load(std::memory_order_acquire);
+                const int64_t diff = static_cast<int64_t>(seq - (pos + 1));
+                if (diff == 0)
+                {
+                    if (slot->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        handler(cell.value);
+                        cell.sequence.store(pos + header->capacity, std::memory_order_release);
+                        NotifySpace();
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = slot->dequeue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Sleeps till a cell is released or the timeout, the release after space_seq is read ends the wait immediately
+        void WaitForSpace(SSlot* slot, SCell* cells)
+        {
+            const uint32_t seq = header->space_seq.load();
+            header->space_waiters.fetch_add(1);
+            if (!IsTailFree(slot, cells))
+            {
+                FutexWait(header->space_seq, seq, std::chrono::milliseconds(100));
+            }
+            header->space_waiters.fetch_sub(1);
+        }
+
+        // The tail cell is busy if the queue is full or the consumer still handles the element of the previous round
+        bool IsTailFree(SSlot* slot, SCell* cells) const
+        {
+            const uint64_t pos = slot->enqueue_pos.load(std::memory_order_relaxed);
+            const uint64_t seq = cells[pos % header->capacity].sequence.load(std::memory_order_acquire);
+            return static_cast<int64_t>(seq - pos) >= 0;
+        }
+
+        void NotifySpace()
+        {
+            header->space_seq.fetch_add(1);
+            if (header->space_waiters.load() != 0)
+                FutexWake(header->space_seq, INT_MAX);
+        }
+
+        static size_t Count(const SSlot* slot)
+        {
+            const uint64_t tail = slot->enqueue_pos.load(std::memory_order_acquire);
+            const uint64_t head = slot->dequeue_pos.load(std::memory_order_acquire);
+            return tail > head ? static_cast<size_t>(tail - head) : 0;
+        }
+
+        SSlot* FindSlot(KeyType id) const
+        {
+            const size_t start = std::hash<KeyType>()(id) % header->max_queues;
+            for (size_t i = 0; i < header->max_queues; ++i)
+            {
+                SSlot* slot = Slot((start + i) % header->max_queues);
+                const uint32_t state = slot->state.load(std::memory_order_acquire);
+                if (state == FREE)
+                    return nullptr;
+                if (state == READY && slot->key == id)
+                    return slot;
+            }
+            return nullptr;
+        }
+
+        SSlot* Slot(size_t index) const
+        {
+            return reinterpret_cast<SSlot*>(memory + SlotsOffset()) + index;
+        }
+
+        size_t SlotIndex(const SSlot* slot) const
+        {
+            return static_cast<size_t>(slot - Slot(0));
+        }
+
+        SCell* Cells(size_t index) const
+        {
+            return reinterpret_cast<SCell*>(memory + CellsOffset(header->max_queues)) + index * header->capacity;
+        }
+
+        static size_t AlignUp(size_t value)
+        {
+            return (value + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+        }
+
+        static size_t SlotsOffset()
+        {
+            return AlignUp(sizeof(SHeader));
+        }
+
+        static size_t CellsOffset(size_t max_queues)
+        {
+            return SlotsOffset() + AlignUp(max_queues * sizeof(SSlot));
+        }
+
+        bool Create(const SSharedMemoryOptions& options)
+        {
+#ifdef MQP_HAS_SHARED_MEMORY
+            if (options.max_queues == 0 || options.capacity == 0)
+                return false;
+
+            const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0)
+                return false;
+
+            memory_size = CellsOffset(options.max_queues) + options.max_queues * options.capacity * sizeof(SCell);
+            if (!Map(fd, memory_size))
+            {
+                shm_unlink(name.c_str());
+                return false;
+            }
+
+            // The memory is zero filled, so all slots are FREE
+            header = new (memory) SHeader();
+            header->version = VERSION;
+            header->key_size = sizeof(KeyType);
+            header->value_size = sizeof(ValueType);
+            header->max_queues = static_cast<uint32_t>(options.max_queues);
+            header->capacity = static_cast<uint32_t>(options.capacity);
+            header->registry_lock.store(0);
+            header->data_seq.store(0);
+            header->consumer_waiting.store(0);
+            header->space_seq.store(0);
+            header->space_waiters.store(0);
+            header->magic.store(MAGIC, std::memory_order_release);
+            return true;
+#else
+            (void)options;
+            return false;
+#endif
+        }
+
+        bool Attach()
+        {
+#ifdef MQP_HAS_SHARED_MEMORY
+            const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+            if (fd < 0)
+                return false;
+
+            struct stat st;
+            if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SHeader) || !Map(fd, static_cast<size_t>(st.st_size)))
+                return false;
+
+            header = reinterpret_cast<SHeader*>(memory);
+
+            // The creator could still initialize the header
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            while (header->magic.load(std::memory_order_acquire) != MAGIC)
+            {
+                if (std::chrono::steady_clock::now() > deadline)
+                    return false;
+                std::this_thread::yield();
+            }
+
+            return header->version == VERSION && header->key_size == sizeof(KeyType) && header->value_size == sizeof(ValueType)
+                && memory_size >= CellsOffset(header->max_queues) + header->max_queues * header->capacity * sizeof(SCell);
+#else
+            return false;
+#endif
+        }
+
+#ifdef MQP_HAS_SHARED_MEMORY
+        bool Map(int fd, size_t size)
+        {
+            bool result = static_cast<size_t>(lseek(fd, 0, SEEK_END)) >= size || ftruncate(fd, static_cast<off_t>(size)) == 0;
+            if (result)
+            {
+                void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                result = ptr != MAP_FAILED;
+                if (result)
+                {
+                    memory = static_cast<char*>(ptr);
+                    memory_size = size;
+                }
+            }
+            close(fd);
+            return result;
+        }
+#endif
+
+        template<typename Rep, typename Period>
+        static void FutexWait(std::atomic<uint32_t>& word, uint32_t expected, const std::chrono::duration<Rep, Period>& timeout)
+        {
+#ifdef __linux__
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+            timespec ts;
+            ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+            ts.tv_nsec = static_cast<long>(ns % 1000000000);
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+#else
+            if (word.load() == expected)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+        }
+
+        static void FutexWake(std::atomic<uint32_t>& word, int count)
+        {
+#ifdef __linux__
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+#else
+            (void)word;
+            (void)count;
+#endif
+        }
+
+        /**
+            \brief Process-shared spin lock of the queue registry. It is held only by CreateQueue and DeleteQueue.
+        */
+        class CRegistryLock
+        {
+        public:
+            explicit CRegistryLock(std::atomic<uint32_t>& word) : lock_word(word)
+            {
+                while (lock_word.exchange(1, std::memory_order_acquire) != 0)
+                    std::this_thread::yield();
+            }
+
+            ~CRegistryLock()
+            {
+                lock_word.store(0, std::memory_order_release);
+            }
+
+        private:
+            std::atomic<uint32_t>& lock_word;
+        };
+
+    protected:
+        std::string name;
+        bool owner;
+        bool ready = false;
+
+        char* memory = nullptr;
+        size_t memory_size = 0;
+        SHeader* header = nullptr;
+
+        std::atomic<bool> running{ false };
+        std::thread th;
+
+        std::mutex subscriptions_mtx;
+        std::map<KeyType, IConsumer<ValueType>*> subscriptions;
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __CSharedMultiQueueProcessor_H__
@@ -0,0 +1,31 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __TestCheck_H__
+#define __TestCheck_H__
+
+#include <iostream>
+
+namespace MultyQueueProcessor
+{
+    /// Number of failed checks of the test executable, it is returned from main
+    inline int& TestFailures()
+    {
+        static int failures = 0;
+        return failures;
+    }
+} // end namespace MultyQueueProcessor
+
+/// Check which is kept in release builds, the failure is reported and counted, the test goes on
+#define MQP_CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            ++MultyQueueProcessor::TestFailures(); \
+        } \
+    } while (false)
+
+#endif // __TestCheck_H__
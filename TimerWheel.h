@@ -0,0 +1,257 @@
+// Copyright 2020 Mykhailo Velygodskyi.
+// All Rights Reserved.
+
+#pragma once
+#ifndef __TimerWheel_H__
+#define __TimerWheel_H__
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+
+namespace MultyQueueProcessor
+{
+    /**
+        \brief Hierarchical timing wheel which keeps items till their due time.
+         There are LEVELS wheels of SLOTS slots, the slot of level k covers SLOTS^k ticks. An item is placed
+         to the lowest level which covers its distance and is moved to lower levels when the time comes.
+         Items which are too far for the last level wait in the overflow list. Add and firing are O(1) per item.
+         It is not thread safe.
+    */
+    template<typename T>
+    class CTimerWheel
+    {
+        static const unsigned SLOT_BITS = 6;
+        static const uint64_t SLOTS = 1u << SLOT_BITS;
+        static const uint64_t SLOT_MASK = SLOTS - 1;
+        static const unsigned LEVELS = 4;
+
+        typedef std::vector<std::pair<uint64_t, T>> Slot;
+
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        /**
+            Constructor of the timing wheel
+            \param [in] tick - resolution of the wheel, items fire not earlier than their due time and not later than one tick after it.
+        */
+        explicit CTimerWheel(Clock::duration tick = std::chrono::milliseconds(1)) :
+            tick(tick > Clock::duration::zero() ? tick : Clock::duration(1)),
+            base(Clock::now()),
+            wheels(LEVELS, std::vector<Slot>(SLOTS)) {}
+
+        /**
+            It adds the item to the wheel.
+            \param [in] due - time when the item should fire, the time in the past means the next Advance.
+            \param [in] item - item to keep.
+        */
+        void Add(Clock::time_point due, T item)
+        {
+            const uint64_t due_tick = ToTick(due);
+            if (count == 0 || next_due_known)
+            {
+                next_due_tick = count == 0 ? std::max(due_tick, current) : std::min(next_due_tick, std::max(due_tick, current));
+                next_due_known = true;
+            }
+            ++count;
+            Insert(due_tick, std::move(item));
+        }
+
+        /**
+            It fires all items whose due time has come.
+            \param [in] now - current time.
+            \param [in] on_due - callable which receives each fired item.
+            \return number of fired items.
+        */
+        template<typename F>
+        size_t Advance(Clock::time_point now, F&& on_due)
+        {
+            size_t fired = 0;
+            if (!expired.empty())
+            {
+                Slot items;
+                items.swap(expired);
+                fired += Fire(items, on_due);
+            }
+
+            const uint64_t now_tick = now > base ? static_cast<uint64_t>((now - base) / tick) : 0;
+            if (count == 0)
+            {
+                current = std::max(current, now_tick);
+                return fired;
+            }
+
+            while (current < now_tick && count > 0)
+            {
+                // Nothing fires or cascades while the lower levels are empty, so the time jumps to the tick
+                // before their next turn, the turn itself is passed by the step below
+                unsigned empty_levels = 0;
+                while (empty_levels + 1 < LEVELS && level_count[empty_levels] == 0)
+                    ++empty_levels;
+                const uint64_t turn = current | ((uint64_t(1) << (SLOT_BITS * empty_levels)) - 1);
+                current = std::max(current, std::min(turn, now_tick - 1));
+
+                ++current;
+                Cascade(1);
+                Slot& slot = wheels[0][current & SLOT_MASK];
+                if (!slot.empty())
+                {
+                    Slot items;
+                    items.swap(slot);
+                    level_count[0] -= items.size();
+                    fired += Fire(items, on_due);
+                }
+
+                // Items cascaded exactly to the current tick
+                if (!expired.empty())
+                {
+                    Slot items;
+                    items.swap(expired);
+                    fired += Fire(items, on_due);
+                }
+            }
+            current = std::max(current, now_tick);
+
+            next_due_known = false;
+            return fired;
+        }
+
+        /// \return time when the earliest item fires or Clock::time_point::max() if the wheel is empty
+        Clock::time_point NextDue()
+        {
+            if (count == 0)
+                return Clock::time_point::max();
+
+            if (!next_due_known)
+            {
+                next_due_tick = FindNextDue();
+                next_due_known = true;
+            }
+            return base + tick * next_due_tick;
+        }
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+    private:
+        uint64_t ToTick(Clock::time_point due) const
+        {
+            if (due <= base)
+                return 0;
+
+            // Rounded up, so the item never fires before its due time
+            const Clock::duration since_base = due - base;
+            return static_cast<uint64_t>((since_base + tick - Clock::duration(1)) / tick);
+        }
+
+        void Insert(uint64_t due_tick, T&& item)
+        {
+            if (due_tick <= current)
+            {
+                expired.emplace_back(due_tick, std::move(item));
+                return;
+            }
+
+            const uint64_t distance = due_tick - current;
+            unsigned level = 0;
+            while (level + 1 < LEVELS && distance >= (uint64_t(1) << (SLOT_BITS * (level + 1))))
+                ++level;
+
+            if (distance >= (uint64_t(1) << (SLOT_BITS * LEVELS)))
+            {
+                overflow.emplace_back(due_tick, std::move(item));
+                return;
+            }
+
+            wheels[level][(due_tick >> (SLOT_BITS * level)) & SLOT_MASK].emplace_back(due_tick, std::move(item));
+            ++level_count[level];
+        }
+
+        // When a level turns over, the next slot of the upper level is distributed to the lower levels
+        void Cascade(unsigned level)
+        {
+            if (level >= LEVELS || ((current >> (SLOT_BITS * (level - 1))) & SLOT_MASK) != 0)
+                return;
+
+            Cascade(level + 1);
+
+            // Overflow items which have come within reach of the last level are moved to it
+            if (level + 1 == LEVELS && !overflow.empty())
+            {
+                Slot items;
+                items.swap(overflow);
+                for (auto& item : items)
+                    Insert(item.first, std::move(item.second));
+            }
+
+            Slot& slot = wheels[level][(current >> (SLOT_BITS * level)) & SLOT_MASK];
+            if (slot.empty())
+                return;
+
+            Slot items;
+            items.swap(slot);
+            level_count[level] -= items.size();
+            for (auto& item : items)
+                Insert(item.first, std::move(item.second));
+        }
+
+        template<typename F>
+        size_t Fire(Slot& items, F& on_due)
+        {
+            for (auto& item : items)
+            {
+                --count;
+                on_due(std::move(item.second));
+            }
+            return items.size();
+        }
+
+        // Slots of one level cover consecutive intervals after the current tick, so the first non empty slot
+        // of each level holds the earliest items of the level. The slot of the current position is the farthest one.
+        uint64_t FindNextDue() const
+        {
+            if (!expired.empty())
+                return current;
+
+            uint64_t result = UINT64_MAX;
+            for (const auto& item : overflow)
+                result = std::min(result, item.first);
+
+            for (unsigned level = 0; level < LEVELS; ++level)
+            {
+                if (level_count[level] == 0)
+                    continue;
+
+                const uint64_t position = current >> (SLOT_BITS * level);
+                for (uint64_t i = 1; i <= SLOTS; ++i)
+                {
+                    const Slot& slot = wheels[level][(position + i) & SLOT_MASK];
+                    if (slot.empty())
+                        continue;
+
+                    for (const auto& item : slot)
+                        result = std::min(result, item.first);
+                    break;
+                }
+            }
+
+            return std::max(result, current);
+        }
+
+    private:
+        Clock::duration tick;
+        Clock::time_point base;
+        uint64_t current = 0;
+        uint64_t next_due_tick = 0;
+        bool next_due_known = false;
+        size_t count = 0;
+        size_t level_count[LEVELS] = {};
+        std::vector<std::vector<Slot>> wheels;
+        Slot expired;
+        Slot overflow;
+    };
+} // end namespace MultyQueueProcessor
+
+#endif // __TimerWheel_H__